@@ -0,0 +1,402 @@
+// Benchmarks for the RCU primitives and RcuList.
+//
+// Usage: bench [--threads N] [--read-percent P] [--list-length L]
+//              [--duration-ms D] [--max-readers R] [--pin]
+//
+// Runs six benchmarks and prints the results as a single JSON object on
+// stdout, along with "mechanism", the RCU mechanism in use (see
+// rcu::Mechanism), and "search_kernel", the SIMD search in use:
+//
+//  - "read_lock": ns per readLock/readUnlock pair on one thread.
+//  - "quiescent_state": ns per QSBR quiescentState on one online thread.
+//  - "cell_read": ns per rcu::Cell read on one thread, next to ns per
+//    std::atomic_load of a std::shared_ptr to the same kind of object.
+//  - "synchronize": synchronize latency percentiles, in ns, with 0 up to
+//    --max-readers threads spinning in read-side critical sections, and how
+//    many critical sections per microsecond each reader got through.
+//  - "synchronize_expedited": the same for synchronizeExpedited.
+//  - "list": RcuList throughput with --threads threads, each doing
+//    --read-percent searches and the rest evenly split pushes and pops, on a
+//    list of about --list-length elements.
+//
+// Built with RCU_STATS, also prints "stats", every rcu::Stat and
+// rcu::Latency collected over the whole run.
+//
+// Build with CMAKE_BUILD_TYPE=Release for meaningful numbers.
+//
+// --pin pins each benchmark thread to its own CPU.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "Cell.hh"
+#include "RCU.hh"
+#include "RcuList.hh"
+#include "SimdSearch.hh"
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    unsigned threads = 4;
+    unsigned readPercent = 90;
+    std::uint64_t listLength = 1000;
+    unsigned durationMs = 1000;
+    unsigned maxReaders = 4;
+    bool pin = false;
+};
+
+void usage(const char *argv0) {
+    std::cerr << "Usage: " << argv0 << " [--threads N] [--read-percent P]"
+              << " [--list-length L] [--duration-ms D] [--max-readers R]"
+              << " [--pin]\n";
+    exit(1);
+}
+
+Options parseOptions(int argc, char **argv) {
+    Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string(argv[i]);
+
+        if (arg == "--pin") {
+            options.pin = true;
+            continue;
+        }
+
+        if (i + 1 == argc) usage(argv[0]);
+        auto value = std::strtoull(argv[++i], nullptr, 10);
+
+        if (arg == "--threads") {
+            options.threads = value;
+        } else if (arg == "--read-percent") {
+            options.readPercent = std::min<unsigned>(value, 100);
+        } else if (arg == "--list-length") {
+            options.listLength = value;
+        } else if (arg == "--duration-ms") {
+            options.durationMs = value;
+        } else if (arg == "--max-readers") {
+            options.maxReaders = value;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (options.threads == 0) usage(argv[0]);
+
+    return options;
+}
+
+void pinToCpu(unsigned idx) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(idx % std::thread::hardware_concurrency(), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+double nsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start)
+        .count();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Read-side overhead.
+//
+
+void benchReadLock(const Options &options) {
+    const std::uint64_t iterations = 100000000;
+
+    if (options.pin) pinToCpu(0);
+
+    auto start = Clock::now();
+    for (std::uint64_t i = 0; i < iterations; ++i) {
+        rcu::readLock();
+        // Keep the compiler from merging or hoisting the critical sections.
+        asm volatile("" ::: "memory");
+        rcu::readUnlock();
+    }
+    auto ns = nsSince(start);
+
+    std::cout << "\"read_lock\": {\"iterations\": " << iterations
+              << ", \"ns_per_op\": " << ns / iterations << "}";
+}
+
+void benchQuiescentState(const Options &options) {
+    const std::uint64_t iterations = 100000000;
+
+    if (options.pin) pinToCpu(0);
+
+    rcu::threadOnline();
+    auto start = Clock::now();
+    for (std::uint64_t i = 0; i < iterations; ++i) {
+        rcu::quiescentState();
+        asm volatile("" ::: "memory");
+    }
+    auto ns = nsSince(start);
+    rcu::threadOffline();
+
+    std::cout << "\"quiescent_state\": {\"iterations\": " << iterations
+              << ", \"ns_per_op\": " << ns / iterations << "}";
+}
+
+void benchCellRead(const Options &options) {
+    const std::uint64_t iterations = 100000000;
+
+    if (options.pin) pinToCpu(0);
+
+    rcu::Cell<std::uint64_t> cell(std::make_unique<std::uint64_t>(1));
+    std::uint64_t sum = 0;
+    auto start = Clock::now();
+    for (std::uint64_t i = 0; i < iterations; ++i) {
+        sum += *cell.read();
+        asm volatile("" ::: "memory");
+    }
+    auto cellNs = nsSince(start);
+    cell.joinGC();
+
+    auto shared = std::make_shared<std::uint64_t>(1);
+    start = Clock::now();
+    for (std::uint64_t i = 0; i < iterations; ++i) {
+        sum += *std::atomic_load(&shared);
+        asm volatile("" ::: "memory");
+    }
+    auto sharedNs = nsSince(start);
+
+    if (sum != 2 * iterations) abort();
+
+    std::cout << "\"cell_read\": {\"iterations\": " << iterations
+              << ", \"ns_per_op\": " << cellNs / iterations
+              << ", \"shared_ptr_ns_per_op\": " << sharedNs / iterations
+              << "}";
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// synchronize latency.
+//
+
+// Spin in read-side critical sections until done, counting them in ops.
+// Bumps started once registered.
+void spinReader(std::atomic<bool> &done, std::atomic<unsigned> &started,
+                unsigned idx, bool pin, std::uint64_t &ops) {
+    if (pin) pinToCpu(idx);
+    rcu::registerCurrentThread();
+    started.fetch_add(1);
+
+    std::uint64_t count = 0;
+    while (!done.load(std::memory_order_relaxed)) {
+        rcu::ReadGuard guard;
+        asm volatile("" ::: "memory");
+        count++;
+    }
+    ops = count;
+
+    rcu::unregisterCurrentThread();
+}
+
+// Print name's latency percentiles, along with how many critical sections
+// per microsecond each reader managed meanwhile.
+void benchSynchronize(const Options &options, const char *name,
+                      void (*synchronize)(void)) {
+    const unsigned samples = 1000;
+
+    std::cout << "\"" << name << "\": [";
+
+    for (unsigned readers = 0; readers <= options.maxReaders; ++readers) {
+        std::atomic<bool> done(false);
+        std::atomic<unsigned> started(0);
+        std::vector<std::thread> threads;
+        std::vector<std::uint64_t> ops(readers);
+
+        for (unsigned i = 0; i < readers; ++i) {
+            threads.emplace_back(spinReader, std::ref(done),
+                                 std::ref(started), i + 1, options.pin,
+                                 std::ref(ops[i]));
+        }
+
+        // Only time synchronize once every reader is in its loop, so that
+        // each row really has that many readers.
+        while (started.load() != readers) {
+            std::this_thread::yield();
+        }
+
+        auto begin = Clock::now();
+        std::vector<double> latencies;
+        for (unsigned i = 0; i < samples; ++i) {
+            auto start = Clock::now();
+            synchronize();
+            latencies.push_back(nsSince(start));
+        }
+
+        done.store(true);
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        auto elapsed = nsSince(begin);
+
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) {
+            return latencies[std::min<size_t>(latencies.size() - 1,
+                                              p * latencies.size())];
+        };
+
+        std::uint64_t totalOps = 0;
+        for (auto n: ops) totalOps += n;
+
+        if (readers != 0) std::cout << ", ";
+        std::cout << "{\"readers\": " << readers
+                  << ", \"p50_ns\": " << percentile(0.5)
+                  << ", \"p90_ns\": " << percentile(0.9)
+                  << ", \"p99_ns\": " << percentile(0.99)
+                  << ", \"max_ns\": " << latencies.back();
+        if (readers != 0) {
+            std::cout << ", \"reader_ops_per_us\": "
+                      << totalOps * 1000.0 / elapsed / readers;
+        }
+        std::cout << "}";
+    }
+
+    std::cout << "]";
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// RcuList throughput.
+//
+
+void listWorker(std::atomic<bool> &go, std::atomic<bool> &done,
+                RcuList &list, const Options &options, unsigned idx,
+                std::uint64_t &ops) {
+    if (options.pin) pinToCpu(idx);
+    rcu::registerCurrentThread();
+
+    std::minstd_rand rng(idx);
+    std::uint64_t count = 0;
+
+    while (!go.load(std::memory_order_relaxed)) {}
+
+    while (!done.load(std::memory_order_relaxed)) {
+        auto roll = rng() % 100;
+        if (roll < options.readPercent) {
+            list.search(rng() % options.listLength);
+        } else if (roll % 2 == 0) {
+            // RcuList expects values to be unique.
+            list.push(((std::uint64_t)idx + 1) << 40 | count);
+        } else {
+            list.pop();
+        }
+        count++;
+    }
+
+    ops = count;
+    rcu::unregisterCurrentThread();
+}
+
+void benchList(const Options &options) {
+    RcuList list;
+
+    for (std::uint64_t i = 0; i < options.listLength; ++i) {
+        list.push(i);
+    }
+
+    std::atomic<bool> go(false);
+    std::atomic<bool> done(false);
+    std::vector<std::uint64_t> ops(options.threads);
+    std::vector<std::thread> threads;
+
+    for (unsigned i = 0; i < options.threads; ++i) {
+        threads.emplace_back(listWorker, std::ref(go), std::ref(done),
+                             std::ref(list), std::cref(options), i,
+                             std::ref(ops[i]));
+    }
+
+    auto start = Clock::now();
+    go.store(true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(options.durationMs));
+    done.store(true);
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    auto seconds = nsSince(start) / 1e9;
+
+    std::uint64_t total = 0;
+    for (auto count: ops) {
+        total += count;
+    }
+
+    std::cout << "\"list\": {\"threads\": " << options.threads
+              << ", \"read_percent\": " << options.readPercent
+              << ", \"list_length\": " << options.listLength
+              << ", \"pinned\": " << (options.pin ? "true" : "false")
+              << ", \"ops\": " << total
+              << ", \"ops_per_sec\": " << total / seconds << "}";
+
+    list.joinGC();
+}
+
+void printStats(void) {
+    auto stats = rcu::statsSnapshot();
+
+    std::cout << "\"stats\": {";
+    for (size_t i = 0; i < rcu::STAT_COUNT; ++i) {
+        auto stat = static_cast<rcu::Stat>(i);
+        std::cout << "\"" << rcu::statName(stat) << "\": " << stats.get(stat)
+                  << ", ";
+    }
+    for (size_t i = 0; i < rcu::LATENCY_COUNT; ++i) {
+        auto latency = static_cast<rcu::Latency>(i);
+        auto &histogram = stats.get(latency);
+        if (i != 0) std::cout << ", ";
+        std::cout << "\"" << rcu::latencyName(latency) << "\": {"
+                  << "\"count\": " << histogram.count()
+                  << ", \"mean\": " << histogram.mean()
+                  << ", \"p50\": " << histogram.percentile(0.5)
+                  << ", \"p99\": " << histogram.percentile(0.99)
+                  << ", \"max\": " << histogram.max() << "}";
+    }
+    std::cout << "}";
+}
+
+int main(int argc, char **argv) {
+    auto options = parseOptions(argc, argv);
+
+    rcu::registerCurrentProcess();
+    rcu::registerCurrentThread();
+
+    std::cout << "{\"mechanism\": \""
+              << rcu::mechanismName(rcu::activeMechanism())
+              << "\", \"search_kernel\": \"" << rcu::searchKernelName()
+              << "\", ";
+    benchReadLock(options);
+    std::cout << ", ";
+    benchQuiescentState(options);
+    std::cout << ", ";
+    benchCellRead(options);
+    std::cout << ", ";
+    benchSynchronize(options, "synchronize", rcu::synchronize);
+    std::cout << ", ";
+    benchSynchronize(options, "synchronize_expedited",
+                     rcu::synchronizeExpedited);
+    std::cout << ", ";
+    benchList(options);
+    if (rcu::STATS_ENABLED) {
+        std::cout << ", ";
+        printStats();
+    }
+    std::cout << "}\n";
+
+    rcu::unregisterCurrentThread();
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+// A single RCU-protected object, for read-mostly data like configuration or
+// routing tables that many threads read and one occasionally replaces.
+//
+// Readers get the current version inside a read-side critical section, which
+// costs them no more than readLock: unlike a std::shared_ptr loaded with
+// std::atomic_load, there is no reference count to bump, and so no shared
+// cache line to write. Writers publish a whole new version with a single
+// exchange, and the old one is deleted by a GarbageCollector once no reader
+// can still be using it. Writers are serialized by a mutex, so that
+// updateWith never loses a concurrent update.
+//
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "RCU.hh"
+
+namespace rcu {
+
+template<typename T, typename Flavor = MembarrierFlavor>
+class Cell {
+public:
+    // A read-side critical section holding on to the version that was
+    // current when it started.
+    //
+    // Only usable on the thread that got it, and only while it lasts.
+    class Snapshot {
+    public:
+        explicit Snapshot(const std::atomic<T *> &current)
+            : guard(), ptr(current) {}
+
+        const T &operator*() const {
+            return *ptr;
+        }
+
+        const T *operator->() const {
+            return ptr.get();
+        }
+
+    private:
+        BasicReadGuard<Flavor> guard;
+        Protected<T *, Flavor> ptr;
+    };
+
+    explicit Cell(std::unique_ptr<T> initial,
+                  GcPolicy policy = GcPolicy())
+        : current(initial.release()), gc(policy) {}
+
+    Cell(const Cell &) = delete;
+    Cell &operator=(const Cell &) = delete;
+
+    // Delete the current version.
+    //
+    // joinGC must already have been called.
+    ~Cell() {
+        delete current.load(std::memory_order_relaxed);
+    }
+
+    void joinGC(void) {
+        gc.join();
+    }
+
+    // Get the current version, to read for as long as the Snapshot lasts.
+    //
+    // Guaranteed copy elision hands back the Snapshot itself, critical
+    // section and all.
+    Snapshot read(void) const {
+        return Snapshot(current);
+    }
+
+    // Call f with the current version, in a read-side critical section, and
+    // return what it returns.
+    template<typename F>
+    auto read(F f) const {
+        Snapshot snapshot(current);
+        return f(*snapshot);
+    }
+
+    // Make next the current version, and retire the old one.
+    //
+    // Must be called from a registered thread, outside read-side critical
+    // sections if the GC's policy may block (see GarbageCollector::discard).
+    void update(std::unique_ptr<T> next) {
+        std::unique_lock lock(writeMutex);
+        publish(std::move(next));
+    }
+
+    // Copy the current version, let f modify the copy, and then publish it
+    // as update does.
+    //
+    // f runs with the write mutex held, so it sees every earlier update,
+    // and none get in before its result is published.
+    template<typename F>
+    void updateWith(F f) {
+        std::unique_lock lock(writeMutex);
+        // Only writers store to current, and we hold the lock.
+        auto next = std::make_unique<T>(
+                *current.load(std::memory_order_relaxed));
+        f(*next);
+        publish(std::move(next));
+    }
+
+private:
+    // An old version waiting for its grace period.
+    struct Retired {
+        std::atomic<Retired *> gcNext;
+        std::unique_ptr<T> version;
+
+        std::atomic<Retired *> &getGcNext(void) {
+            return gcNext;
+        }
+    };
+
+    // Must hold writeMutex.
+    void publish(std::unique_ptr<T> next) {
+        // Allocate first, so that nothing is published if this throws.
+        auto retired = std::make_unique<Retired>();
+
+        // The release half synchronizes-with Protected's acquire load, so
+        // that readers see next fully constructed.
+        std::unique_ptr<T> old(current.exchange(next.release(),
+                std::memory_order_acq_rel));
+
+        retired->gcNext.store(nullptr, std::memory_order_relaxed);
+        retired->version = std::move(old);
+        gc.discard(retired.release());
+    }
+
+    std::atomic<T *> current;
+    std::mutex writeMutex;
+    GarbageCollector<Retired, std::default_delete<Retired>, Flavor> gc;
+};
+
+}
@@ -0,0 +1,331 @@
+// A hash array mapped trie (HAMT) set of strings.
+//
+// Each level of the trie consumes BITS_PER_LEVEL bits of the key's hash, and
+// each internal node stores only the children it actually has, found by
+// popcount on a bitmap. Once a key's 64-bit hash is used up, we continue with
+// "backup hashes" drawn from the key itself (see getNthBackup in HAMT.cc),
+// so any two distinct keys are eventually separated.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+//////////////////////////////////////////////////////////////////////////////
+// Constants.
+//
+
+// How many bits of the hash each level of the trie consumes.
+const unsigned BITS_PER_LEVEL = 6;
+
+// Masks off the bits of the hash the current level uses.
+const std::uint64_t FIRST_N_BITS = (1ULL << BITS_PER_LEVEL) - 1;
+
+// How many levels a single 64-bit hash lasts.
+const unsigned LEVELS_PER_HASH = 64 / BITS_PER_LEVEL;
+
+// The number of entries in the top-level node.
+const unsigned TOP_LEVEL_ENTRIES = 1 << BITS_PER_LEVEL;
+
+// Keys up to this long are stored inside their HamtLeaf, rather than in a
+// separate allocation.
+const size_t INLINE_KEY_BYTES = 24;
+
+// How many lookups findBatch interleaves at once.
+const size_t HAMT_BATCH_GROUP = 16;
+
+// The size, and alignment, of each slab a HamtNodeArena allocates.
+const size_t HAMT_SLAB_BYTES = 16 * 1024;
+
+//////////////////////////////////////////////////////////////////////////////
+// Hash definitions.
+//
+
+uint64_t getNthBackup(std::string_view str, unsigned n);
+
+//////////////////////////////////////////////////////////////////////////////
+// Trie nodes.
+//
+
+class HamtNode;
+struct HamtLeaf;
+
+// A size-classed allocator for HamtNodes, with one freelist per child count.
+//
+// Every insert or erase that changes a node's child count replaces the node
+// with one of a different size, which is a lot of malloc churn. An arena
+// instead carves nodes out of slabs that each hold a single size, and keeps
+// freed nodes on per-size freelists for reuse. Slabs are aligned to their
+// size, so operator delete finds a node's arena and size by masking its
+// address.
+//
+// allocate must be serialized by the arena's user, but nodes may be freed
+// from any thread: that's how an RcuHamt's retired nodes come back after a
+// grace period.
+class HamtNodeArena {
+public:
+    HamtNodeArena();
+
+    HamtNodeArena(const HamtNodeArena &) = delete;
+    HamtNodeArena &operator=(const HamtNodeArena &) = delete;
+
+    // Free every slab. Every node must already have been freed.
+    ~HamtNodeArena();
+
+    // Get memory for a node with nChildren children.
+    void *allocate(int nChildren);
+
+    // Return memory from allocate to its arena, poisoning it with RCU_POISON
+    // (see Poison.hh).
+    //
+    // Lock-free. May be called from any thread.
+    static void deallocate(void *p);
+
+private:
+    // An unallocated node.
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    // The start of every slab.
+    struct Slab {
+        HamtNodeArena *arena;
+        int nChildren;
+        Slab *nextSlab;
+    };
+
+    static Slab *slabOf(void *p);
+
+    // Move everything in remote to the freelists.
+    void takeRemote();
+
+    void newSlab(int nChildren);
+
+    // One freelist per child count, indexed by nChildren - 1. Only touched by
+    // allocate.
+    FreeBlock *freeLists[TOP_LEVEL_ENTRIES];
+    // Freed nodes of every size, waiting for takeRemote.
+    std::atomic<FreeBlock *> remote;
+    Slab *slabs;
+};
+
+// A tagged pointer to either a HamtNode, a HamtLeaf, or nothing.
+//
+// Owns whatever it points to. The low bit is set for leaves.
+class HamtNodeEntry {
+public:
+    explicit HamtNodeEntry(std::unique_ptr<HamtNode> node);
+    explicit HamtNodeEntry(std::unique_ptr<HamtLeaf> leaf);
+    HamtNodeEntry();
+
+    HamtNodeEntry(HamtNodeEntry &&other);
+    HamtNodeEntry &operator=(HamtNodeEntry &&other);
+
+    HamtNodeEntry(const HamtNodeEntry &) = delete;
+    HamtNodeEntry &operator=(const HamtNodeEntry &) = delete;
+
+    // Make a second entry pointing at the same thing as this one.
+    //
+    // Both entries then own it, so all but one of them must be release()d
+    // or otherwise forgotten before they're destroyed. Used for structural
+    // sharing between versions of an RcuHamt.
+    HamtNodeEntry share() const;
+
+    // Whether this entry points at the same thing as other, as entries
+    // share()d from one another do.
+    bool sharesWith(const HamtNodeEntry &other) const;
+
+    // Forget what we point to, without destroying it.
+    void release();
+
+    bool isLeaf() const;
+    bool isNull() const;
+
+    // Start fetching whatever this entry points to into cache.
+    void prefetchTarget() const;
+
+    std::unique_ptr<HamtNode> takeChild();
+    HamtNode &getChild();
+    const HamtNode &getChild() const;
+
+    std::unique_ptr<HamtLeaf> takeLeaf();
+    HamtLeaf &getLeaf();
+    const HamtLeaf &getLeaf() const;
+
+    ~HamtNodeEntry();
+
+private:
+    std::uintptr_t ptr;
+};
+
+// A key, and its hash as of the level it's at.
+//
+// Keys of up to INLINE_KEY_BYTES are stored inline, so that checking one
+// touches a single cache line.
+struct HamtLeaf {
+    HamtLeaf(std::string_view data, uint64_t hash);
+
+    HamtLeaf(const HamtLeaf &) = delete;
+    HamtLeaf &operator=(const HamtLeaf &) = delete;
+
+    ~HamtLeaf();
+
+    // The plain global ones, except that delete poisons the leaf with
+    // RCU_POISON (see Poison.hh).
+    static void *operator new(size_t bytes);
+    static void operator delete(void *p, size_t bytes);
+
+    std::string_view data() const;
+
+    // Whether this leaf holds str, whose hash as of this leaf's level is
+    // hash.
+    //
+    // The hash doubles as a fingerprint: it's compared first, and nearly
+    // always settles a mismatch without looking at the key.
+    bool matches(uint64_t hash, std::string_view str) const;
+
+    // The key's hash, as of the level this leaf is at.
+    uint64_t hash;
+    // The RcuHamt version this leaf was created in (see RcuHamt::Snapshot).
+    // Unused by a plain Hamt.
+    uint64_t version = 0;
+
+private:
+    std::uint32_t size;
+    union {
+        char inlineData[INLINE_KEY_BYTES];
+        // For keys longer than INLINE_KEY_BYTES.
+        char *heapData;
+    };
+};
+
+// An internal node of the trie.
+//
+// Variable-size: allocate with `new (arena, nChildren) HamtNode(...)`.
+// children are sorted by descending hash; numberOfHashesAbove gives the
+// index.
+class HamtNode {
+public:
+    // A node with a single child.
+    HamtNode(uint64_t hash, HamtNodeEntry entry);
+
+    // A node with two children (with different hashes).
+    HamtNode(uint64_t hash1, HamtNodeEntry entry1,
+             uint64_t hash2, HamtNodeEntry entry2);
+
+    // Move node's children into a new node, without the child at hash.
+    //
+    // Allocate with one less child than node has.
+    HamtNode(std::unique_ptr<HamtNode> node, uint64_t hash);
+
+    // Move node's children into a new node, along with entry at hash.
+    //
+    // Allocate with one more child than node has.
+    HamtNode(std::unique_ptr<HamtNode> node, HamtNodeEntry entry,
+             uint64_t hash);
+
+    // Copy-on-write versions of the constructors above.
+    //
+    // Rather than moving node's children, these share them with node (see
+    // HamtNodeEntry::share), leaving node untouched so that concurrent
+    // readers can keep using it. Once the new node is published, node must
+    // be destroyed with releaseChildren and then delete.
+    explicit HamtNode(const HamtNode &node);
+    HamtNode(const HamtNode &node, uint64_t hash);
+    HamtNode(const HamtNode &node, HamtNodeEntry entry, uint64_t hash);
+
+    // Replace the child at hash with entry, without destroying the old child.
+    //
+    // Only for use on fresh copies from the copy-on-write constructors, where
+    // the old child is shared.
+    void overwriteChild(uint64_t hash, HamtNodeEntry entry);
+
+    // Forget every child without destroying it.
+    //
+    // The map is left alone, so the node can still be freed with delete.
+    void releaseChildren();
+
+    int numberOfChildren() const;
+    uint64_t numberOfHashesAbove(uint64_t hash) const;
+    bool containsHash(uint64_t hash) const;
+
+    ~HamtNode();
+
+    static void *operator new(size_t, HamtNodeArena &arena, int nChildren);
+    static void operator delete(void *p);
+
+    // The RcuHamt version this node was created in (see RcuHamt::Snapshot).
+    // Unused by a plain Hamt.
+    uint64_t version = 0;
+    uint64_t map;
+    HamtNodeEntry children[1];
+
+private:
+    void markHash(uint64_t hash);
+    void unmarkHash(uint64_t hash);
+};
+
+// The root of the trie, with a full table of TOP_LEVEL_ENTRIES entries.
+class TopLevelHamtNode {
+public:
+    TopLevelHamtNode() = default;
+
+    // A copy-on-write copy: shares every entry with other. See HamtNode's
+    // copy-on-write constructors.
+    explicit TopLevelHamtNode(const TopLevelHamtNode &other);
+
+    // New nodes come from arena.
+    void insert(HamtNodeArena &arena, uint64_t hash, std::string &&str);
+    bool find(uint64_t hash, const std::string &str) const;
+    bool erase(HamtNodeArena &arena, uint64_t hash, const std::string &str);
+
+    // Set found[i] to find(hashes[i], keys[i]), for up to HAMT_BATCH_GROUP
+    // keys.
+    //
+    // Rather than chasing one key's pointers at a time, walks all the keys a
+    // level at a time, prefetching each key's next node before touching it,
+    // so that the cache misses for different keys overlap.
+    void findBatch(const uint64_t *hashes, const std::string *keys,
+                   size_t nKeys, bool *found) const;
+
+    // Forget every entry without destroying it.
+    void releaseChildren();
+
+    // The plain global ones, except that delete poisons the node with
+    // RCU_POISON (see Poison.hh).
+    static void *operator new(size_t bytes);
+    static void operator delete(void *p, size_t bytes);
+
+    // Which version of an RcuHamt this is, counting from 0 (see
+    // RcuHamt::Snapshot). Unused by a plain Hamt.
+    uint64_t version = 0;
+    HamtNodeEntry table[TOP_LEVEL_ENTRIES];
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// The single-threaded set.
+//
+
+class Hamt {
+public:
+    void insert(std::string &&str);
+    bool find(const std::string &str) const;
+    bool erase(const std::string &str);
+
+    // Set found[i] to find(keys[i]) for every i below nKeys.
+    //
+    // Much faster than calling find in a loop once the trie doesn't fit in
+    // cache; see TopLevelHamtNode::findBatch.
+    void findBatch(const std::string *keys, size_t nKeys, bool *found) const;
+
+private:
+    // Declared before root, so that it outlives root's nodes.
+    HamtNodeArena arena;
+    TopLevelHamtNode root;
+    std::hash<std::string> hasher;
+};
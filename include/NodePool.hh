@@ -0,0 +1,213 @@
+// A per-thread slab allocator for fixed-size RCU-protected nodes.
+//
+// Nodes in RCU-protected structures are typically allocated by one thread and
+// freed, a grace period later, by a GC thread. Going through malloc for that
+// is slow, and frees on the GC thread defeat the allocator's per-thread
+// caches. A NodePool instead carves nodes out of large slabs owned by the
+// allocating thread, and returns freed nodes to the freelist of the thread
+// that owns their slab.
+//
+// Slabs also remember the NUMA node they were allocated on, which sharded
+// GarbageCollectors use to free nodes from a GC thread on that node.
+//
+// With RCU_POISON, destroyed nodes are poisoned (see Poison.hh).
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+#include "Poison.hh"
+#include "RCU.hh"
+
+namespace rcu {
+
+//////////////////////////////////////////////////////////////////////////////
+// Constants.
+//
+
+// The size, and alignment, of each slab a NodePool allocates.
+//
+// Since slabs are aligned to their size, the slab a node belongs to can be
+// found just by masking its address.
+const size_t SLAB_BYTES = 64 * 1024;
+
+//////////////////////////////////////////////////////////////////////////////
+// NodePool.
+//
+
+template<typename T>
+class NodePool {
+public:
+    // Disposes of nodes for a GarbageCollector by returning them to a pool.
+    struct Deleter {
+        NodePool *pool;
+
+        void operator()(T *t) const {
+            pool->destroy(t);
+        }
+
+        unsigned nodeOf(const T *t) const {
+            return slabOf(t)->node;
+        }
+    };
+
+    NodePool() : slabs(nullptr) {}
+
+    NodePool(const NodePool &) = delete;
+    NodePool &operator=(const NodePool &) = delete;
+
+    // Free every slab.
+    //
+    // Nodes still allocated from the pool are not destroyed, so they must
+    // either already have been destroyed or be trivially destructible.
+    ~NodePool() {
+        auto cur = slabs.load(std::memory_order_relaxed);
+        while (cur != nullptr) {
+            auto next = cur->nextSlab;
+            std::free(cur);
+            cur = next;
+        }
+    }
+
+    // Allocate a node and construct it from args.
+    //
+    // Usually just pops the current thread's freelist. Doesn't touch
+    // anything shared unless the freelist is empty.
+    //
+    // Must be called from a registered thread.
+    template<typename... Args>
+    T *create(Args &&...args) {
+        auto &cache = caches.local();
+        return new (allocate(cache)) T { std::forward<Args>(args)... };
+    }
+
+    // Destroy a node and return it to the thread that owns its slab.
+    //
+    // As with delete, the caller is responsible for making sure no-one can
+    // still be reading t, typically by calling this a grace period after
+    // unlinking it (e.g. via GarbageCollector).
+    //
+    // Lock-free. May be called from any thread, registered or not.
+    void destroy(T *t) {
+        t->~T();
+        poison(t, SLOT_BYTES);
+
+        auto slot = reinterpret_cast<FreeSlot *>(t);
+        auto &remote = caches.get(slabOf(t)->owner).remote;
+
+        // The owner only ever takes the whole list, so this CAS is not
+        // subject to the ABA problem.
+        auto oldHead = remote.load(std::memory_order_relaxed);
+        do {
+            slot->next = oldHead;
+        } while (!remote.compare_exchange_weak(oldHead, slot,
+                    std::memory_order_release, std::memory_order_relaxed));
+    }
+
+private:
+    // An unallocated node.
+    struct FreeSlot {
+        FreeSlot *next;
+    };
+
+    // The start of every slab.
+    //
+    // Padded to a cache line so that nodes don't share a line with it.
+    struct alignas(CACHE_LINE_BYTES) SlabHeader {
+        // The index of the thread that allocated the slab. Nodes freed from
+        // this slab go to that index's freelist, even if the thread has since
+        // unregistered and its index been reused.
+        unsigned owner;
+        // The NUMA node the owner was running on when it allocated the slab.
+        // The kernel usually backs the slab with memory from there.
+        unsigned node;
+        SlabHeader *nextSlab;
+    };
+
+    static SlabHeader *slabOf(const T *t) {
+        return reinterpret_cast<SlabHeader *>(
+                reinterpret_cast<std::uintptr_t>(t) & ~(SLAB_BYTES - 1));
+    }
+
+    // Each thread's share of the pool.
+    struct ThreadCache {
+        // Only touched by the owning thread.
+        alignas(CACHE_LINE_BYTES) FreeSlot *local;
+        // Nodes that haven't been handed out yet in the most recent slab.
+        char *bump;
+        char *bumpEnd;
+        // Nodes freed back to this thread by others. Kept on its own cache
+        // line, since other threads write it.
+        alignas(CACHE_LINE_BYTES) std::atomic<FreeSlot *> remote;
+    };
+
+    static constexpr size_t SLOT_ALIGN =
+        std::max(alignof(T), alignof(FreeSlot));
+    static constexpr size_t SLOT_BYTES =
+        (std::max(sizeof(T), sizeof(FreeSlot)) + SLOT_ALIGN - 1)
+        & ~(SLOT_ALIGN - 1);
+
+    static_assert(SLOT_ALIGN <= CACHE_LINE_BYTES,
+                  "NodePool nodes can be aligned to at most a cache line");
+    static_assert(sizeof(SlabHeader) + SLOT_BYTES <= SLAB_BYTES,
+                  "NodePool nodes must fit in a slab");
+
+    void *allocate(ThreadCache &cache) {
+        if (cache.local == nullptr
+         && cache.remote.load(std::memory_order_relaxed) != nullptr) {
+            // Synchronizes-with the committing CAS in destroy, so we see the
+            // updated next pointers.
+            cache.local = cache.remote.exchange(nullptr,
+                    std::memory_order_acquire);
+        }
+
+        if (cache.local != nullptr) {
+            auto slot = cache.local;
+            cache.local = slot->next;
+            return slot;
+        }
+
+        if (cache.bump == cache.bumpEnd) {
+            newSlab(cache);
+        }
+
+        auto slot = cache.bump;
+        cache.bump += SLOT_BYTES;
+        return slot;
+    }
+
+    void newSlab(ThreadCache &cache) {
+        auto mem = std::aligned_alloc(SLAB_BYTES, SLAB_BYTES);
+        if (mem == nullptr) {
+            throw std::bad_alloc();
+        }
+
+        auto slab = new (mem) SlabHeader {
+            currentThreadIndex(), currentNumaNode(), nullptr
+        };
+
+        // Remember the slab so the destructor can free it.
+        auto oldSlabs = slabs.load(std::memory_order_relaxed);
+        do {
+            slab->nextSlab = oldSlabs;
+        } while (!slabs.compare_exchange_weak(oldSlabs, slab,
+                    std::memory_order_relaxed));
+
+        auto start = static_cast<char *>(mem) + sizeof(SlabHeader);
+        auto nSlots = (SLAB_BYTES - sizeof(SlabHeader)) / SLOT_BYTES;
+        cache.bump = start;
+        cache.bumpEnd = start + nSlots * SLOT_BYTES;
+    }
+
+    PerThread<ThreadCache> caches;
+    // Every slab this pool has allocated.
+    std::atomic<SlabHeader *> slabs;
+};
+
+}
@@ -0,0 +1,53 @@
+// Poisoning freed memory, for catching readers that outlive their grace
+// period.
+//
+// If RCU_POISON is defined (or configured with -DRCU_POISON=ON), memory is
+// overwritten with POISON_BYTE as it is freed by:
+//
+//  - NodePool, and so RcuList, RcuUnrolledList, RcuHashMap and RcuQueue
+//  - RcuSkipList's nodes
+//  - HAMT nodes (through HamtNodeArena), leaves and roots, and so RcuHamt
+//
+// A reader that keeps using freed memory then reads garbage rather than
+// plausible stale data, and following a poisoned pointer faults straight
+// away. Cell's versions, and whatever other Deleters a GarbageCollector is
+// given, are the caller's to poison. Like RCU_STATS, it must be set the same
+// way in every translation unit.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+namespace rcu {
+
+//////////////////////////////////////////////////////////////////////////////
+// Constants.
+//
+
+#ifdef RCU_POISON
+constexpr bool POISON_ENABLED = true;
+#else
+constexpr bool POISON_ENABLED = false;
+#endif
+
+// What freed memory is filled with when poisoning. Pointers made of it are
+// non-canonical on x86-64, and misaligned everywhere.
+const unsigned char POISON_BYTE = 0xA5;
+
+//////////////////////////////////////////////////////////////////////////////
+// Poisoning.
+//
+
+// Fill the bytes bytes at p with POISON_BYTE, if poisoning is enabled.
+inline void poison(void *p, size_t bytes) {
+    if (!POISON_ENABLED) return;
+
+    std::memset(p, POISON_BYTE, bytes);
+    // The memory is usually about to be freed, which would otherwise let the
+    // compiler drop the stores as dead.
+    asm volatile("" : : "r"(p) : "memory");
+}
+
+}
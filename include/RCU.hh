@@ -15,19 +15,26 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <chrono>
-#include <iostream>
+#include <condition_variable>
+#include <cstdint>
 #include <mutex>
 #include <thread>
 #include <type_traits>
-#include <list>
+#include <memory>
 
 #include <linux/membarrier.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 
+#include "Stats.hh"
+
 namespace rcu {
 
 //////////////////////////////////////////////////////////////////////////////
@@ -43,20 +50,82 @@ const std::uint64_t GP_COUNTER_MASK = 1ULL << 63;
 // The bits where we store each thread's critical-section nesting level.
 const std::uint64_t NESTING_MASK    = ~GP_COUNTER_MASK;
 
+// The most threads that may be registered at once.
+const unsigned MAX_THREADS = 4096;
+
+// Per-thread state indexed by thread index is allocated in chunks of this
+// many threads.
+const unsigned THREADS_PER_CHUNK = 64;
+
+// How many objects a thread buffers in GarbageCollector::discard before
+// handing them to the GC thread.
+const size_t DISCARD_BATCH_SIZE = 64;
+
+// The most NUMA nodes we tell apart. Any with higher IDs count as the last
+// one.
+const unsigned MAX_NUMA_NODES = 64;
+
+// How many times synchronize busy-waits on a reader (with a CPU pause
+// between checks) before it starts yielding the CPU.
+const unsigned SPIN_ATTEMPTS  = 1000;
+
+// How many times synchronize yields the CPU while waiting on a reader before
+// it parks on gpFutex.
+const unsigned YIELD_ATTEMPTS = 100;
+
+// How long a synchronizer sleeps between checks on a reader that won't wake it
+// (QSBR readers, and readers with the FENCE mechanism) once it is done
+// spinning and yielding.
+const std::chrono::microseconds POLL_INTERVAL(50);
+
+// How long a grace period waits on a single reader before reporting it as
+// stalled, until setStallDetector says otherwise.
+const std::chrono::seconds DEFAULT_STALL_TIMEOUT(1);
+
 //////////////////////////////////////////////////////////////////////////////
 // The RCU public interface.
 //
 
+// How synchronize makes sure readers' accesses are ordered around their
+// critical sections, fastest first.
+enum class Mechanism {
+    // The expedited private membarrier syscall forces every thread to run a
+    // memory barrier, so readers only need compiler barriers.
+    MEMBARRIER,
+    // Without it, synchronize sends each registered thread RCU_SIGNAL, whose
+    // handler runs the barrier, and waits for them all to acknowledge it.
+    // Readers are just as cheap, but synchronize is slower, and the
+    // signal is reserved for RCU.
+    SIGNAL,
+    // Failing that, readers run real memory barriers around their critical
+    // sections.
+    FENCE,
+};
+
+// The signal the SIGNAL mechanism uses. Define RCU_SIGNAL when building RCU to
+// use another one.
+#ifndef RCU_SIGNAL
+#define RCU_SIGNAL SIGUSR1
+#endif
+
 // Register that the current process wants to use RCU.
 //
 // Must be called before any other thread in the process calls any other
 // methods. Only needs to be called once; subsequent calls will have the
 // same return value and no additional effect.
 //
-// Returns a boolean which is true on success, or false on failure.
-// Failures occur if the system doesn't support expedited Linux
-// `membarrier`. If this method fails RCU will not work.
-bool registerCurrentProcess(void);
+// Uses the preferred mechanism if the system supports it, and otherwise the
+// fastest one after it that it does. SIGNAL is unavailable if something else
+// already handles RCU_SIGNAL; FENCE always works.
+//
+// Returns true, now that there is always a mechanism that works.
+bool registerCurrentProcess(Mechanism preferred = Mechanism::MEMBARRIER);
+
+// The mechanism registerCurrentProcess picked.
+Mechanism activeMechanism(void);
+
+// A short name for a mechanism, e.g. for logging which one a host got.
+const char *mechanismName(Mechanism mechanism);
 
 // Add the current thread to the RCU registry.
 //
@@ -71,6 +140,46 @@ void registerCurrentThread(void);
 // thread. Until the thread is re-registered it cannot use RCU.
 void unregisterCurrentThread(void);
 
+// Get the current thread's index.
+//
+// Every registered thread has a distinct index less than MAX_THREADS. Indices
+// are reused once their threads unregister, so they stay dense: useful for
+// indexing per-thread state.
+inline unsigned currentThreadIndex(void);
+
+// Something to run on each thread as it unregisters.
+//
+// Used to flush per-thread state, like GarbageCollector's discard buffers,
+// before the thread goes away. func is called with arg, on the unregistering
+// thread, while holding the hook lock: it must not add or remove hooks.
+struct UnregisterHook {
+    void (*func)(void *);
+    void *arg;
+};
+
+// Add a hook to run whenever a thread unregisters.
+//
+// The hook must stay alive until it is removed.
+void addUnregisterHook(UnregisterHook *hook);
+
+// Remove a hook previously added with addUnregisterHook.
+void removeUnregisterHook(UnregisterHook *hook);
+
+// Tell the CPU we're in a spin loop.
+inline void cpuRelax(void);
+
+// One more than the highest online NUMA node ID, at most MAX_NUMA_NODES, or
+// 1 if the kernel doesn't say (e.g. without NUMA support).
+unsigned numaNodeCount(void);
+
+// The NUMA node of the CPU the calling thread is running on, which may of
+// course change at any moment.
+unsigned currentNumaNode(void);
+
+// Restrict the calling thread to the CPUs of the given NUMA node. Returns
+// false, leaving the thread alone, if the node has no CPUs or doesn't exist.
+bool pinToNumaNode(unsigned node);
+
 // Delay reclamation of memory by other threads.
 //
 // Readers and writers should call readLock before starting a read
@@ -106,9 +215,30 @@ void unregisterCurrentThread(void);
 // quiescent states.
 inline void readLock(void);
 
-// An a read-side critical section.
+// End a read-side critical section.
 inline void readUnlock(void);
 
+// A registered thread's handle on its own registry entry.
+//
+// Readers in hot loops can fetch this once with currentThreadEntry and pass
+// it to readLock and readUnlock, saving a thread-local lookup per call. It is
+// only valid on the thread that fetched it, until that thread unregisters.
+struct PerThreadEntry;
+
+// Get the current thread's registry entry.
+inline PerThreadEntry *currentThreadEntry(void);
+
+// Equivalent to readLock(), given self == currentThreadEntry().
+inline void readLock(PerThreadEntry *self);
+
+// Equivalent to readUnlock(), given self == currentThreadEntry().
+inline void readUnlock(PerThreadEntry *self);
+
+// Whether the current thread is in a read-side critical section.
+//
+// Mostly useful for assertions.
+inline bool inReadSection(void);
+
 // Wait until it is safe to reclaim inaccessible previously-shared memory.
 //
 // Specifically, waits until every reader thread is known to have passed
@@ -142,191 +272,1058 @@ inline void readUnlock(void);
 // 3. Delete N2. This is now safe, because we have the only remaining
 //    pointer to it.
 //
+// Concurrent callers share grace periods: a call that arrives while a grace
+// period is already in progress waits for the next one to finish rather than
+// running its own, and every caller waiting for that next grace period
+// returns once it's done. So K concurrent callers cost about two grace
+// periods rather than K.
+//
+// With the MEMBARRIER mechanism, this uses the non-expedited
+// MEMBARRIER_CMD_GLOBAL where the kernel has it. That doesn't interrupt
+// readers, but waits for every CPU to pass through the scheduler, so a grace
+// period can take milliseconds. Use synchronizeExpedited where that matters
+// more than reader jitter.
 void synchronize(void);
 
+// synchronize, but with the expedited private membarrier, which interrupts
+// every CPU running one of our threads to make it run a barrier, so it
+// usually takes microseconds.
+//
+// The two share grace periods with each other, so this may still wait for
+// part of a slow one that's already in progress.
+void synchronizeExpedited(void);
+
+//////////////////////////////////////////////////////////////////////////////
+// Stall detection.
+//
+// A reader that never leaves its critical section (or a QSBR thread that
+// stays online without announcing quiescent states) holds up every grace
+// period after it, and with them all reclamation. Grace periods that wait
+// on a single reader for longer than the stall timeout report it.
+//
+
+// A reader holding up a grace period.
+struct ReaderStall {
+    // Its thread index (see currentThreadIndex), and its kernel thread ID.
+    unsigned index;
+    pid_t tid;
+    // How long the grace period has been waiting on it.
+    std::chrono::nanoseconds waited;
+};
+
+// Called as a grace period reports a stall, first after one stall timeout,
+// and then again after each further one for as long as the stall lasts.
+//
+// Runs on the synchronizing thread, in the middle of its grace period, so it
+// must not wait for a grace period itself.
+using StallHandler = void (*)(const ReaderStall &stall);
+
+struct StallStats {
+    // How many stalls have been detected so far, each counted once however
+    // many times it was reported.
+    std::uint64_t stalls;
+    // Whether a grace period is waiting on a stalled reader right now, and if
+    // so, the latest report about it.
+    bool stalled;
+    ReaderStall current;
+};
+
+// Report stalls once a grace period has waited on a reader for timeout,
+// calling handler (if not null) with each report. A timeout of 0 turns
+// detection off.
+//
+// May be called at any time, from any thread.
+void setStallDetector(std::chrono::nanoseconds timeout,
+                      StallHandler handler = nullptr);
+
+// The stall counters, for monitoring.
+StallStats stallStats(void);
+
+//////////////////////////////////////////////////////////////////////////////
+// Quiescent-state-based RCU (QSBR).
+//
+// An alternative to readLock and readUnlock for threads, like event-loop
+// workers, that can tell when they hold no RCU-protected pointers. Such a
+// thread goes online, and from then on is considered to be in a read-side
+// critical section whenever it isn't announcing a quiescent state: read-side
+// sections cost nothing, and QsbrFlavor::synchronize instead waits for every
+// online thread to call quiescentState (or go offline).
+//
+// The two are independent: synchronize ignores QSBR threads, and
+// QsbrFlavor::synchronize ignores readLock. Structures must pick one flavor
+// (see below), and only be read by threads using it.
+//
+
+// Start taking part in QSBR grace periods, as if entering a critical
+// section. Registered threads start offline.
+inline void threadOnline(void);
+
+// Stop taking part, e.g. before blocking for a long time, as if leaving a
+// critical section. Unregistering goes offline too.
+inline void threadOffline(void);
+
+// Announce that this online thread holds no RCU-protected pointers.
+//
+// Equivalent to leaving a critical section and immediately entering a new
+// one, and costs about as much as two plain memory accesses.
+inline void quiescentState(void);
+
+// Whether the current thread is online.
+inline bool isOnline(void);
+
+//////////////////////////////////////////////////////////////////////////////
+// Flavors.
+//
+// RCU-protected structures, and the helpers below, take a Flavor parameter
+// saying how their readers delimit critical sections and how writers wait
+// for them. A Flavor has static readLock, readUnlock, inReadSection and
+// synchronize members with the semantics of the free functions above, and a
+// static entry member that gets the PerThreadEntry its readLock and
+// readUnlock want.
+//
+
+// The default: critical sections delimited by readLock and readUnlock, with
+// membarrier (or a fallback; see Mechanism) to keep them cheap.
+struct MembarrierFlavor {
+    static PerThreadEntry *entry(void) {
+        return currentThreadEntry();
+    }
+
+    static void readLock(PerThreadEntry *self) {
+        rcu::readLock(self);
+    }
+
+    static void readUnlock(PerThreadEntry *self) {
+        rcu::readUnlock(self);
+    }
+
+    static bool inReadSection(void) {
+        return rcu::inReadSection();
+    }
+
+    static void synchronize(void) {
+        rcu::synchronize();
+    }
+};
+
+// QSBR: critical sections are implied by quiescentState, so readLock and
+// readUnlock compile to nothing, and readers must be online.
+struct QsbrFlavor {
+    static PerThreadEntry *entry(void) {
+        return nullptr;
+    }
+
+    static void readLock(PerThreadEntry *) {}
+
+    static void readUnlock(PerThreadEntry *) {}
+
+    static bool inReadSection(void) {
+        return isOnline();
+    }
+
+    // Wait until every other thread that is online now has announced a
+    // quiescent state or gone offline.
+    //
+    // Concurrent callers share their waits. If the caller is online, it
+    // counts as announcing a quiescent state.
+    static void synchronize(void);
+};
+
+// A read-side critical section lasting as long as the guard.
+//
+// Equivalent to calling readLock on construction and readUnlock on
+// destruction, and compiles to the same thing, but can't forget the unlock on
+// an early return.
+template<typename Flavor>
+class BasicReadGuard {
+public:
+    BasicReadGuard() : BasicReadGuard(Flavor::entry()) {}
+
+    // See currentThreadEntry.
+    explicit BasicReadGuard(PerThreadEntry *self) : self(self) {
+        Flavor::readLock(self);
+    }
+
+    BasicReadGuard(const BasicReadGuard &) = delete;
+    BasicReadGuard &operator=(const BasicReadGuard &) = delete;
+
+    ~BasicReadGuard() {
+        Flavor::readUnlock(self);
+    }
+
+private:
+    PerThreadEntry *self;
+};
+
+using ReadGuard = BasicReadGuard<MembarrierFlavor>;
+
+// A pointer loaded from RCU-protected shared data.
+//
+// Only valid while the read-side critical section it was loaded in lasts.
+// Debug builds check that it is only loaded and dereferenced inside a
+// read-side critical section; in release builds it is just a pointer.
+template<typename P, typename Flavor = MembarrierFlavor>
+class Protected;
+
+template<typename T, typename Flavor>
+class Protected<T *, Flavor> {
+public:
+    Protected() : ptr(nullptr) {}
+
+    // Load an RCU-protected pointer.
+    //
+    // Synchronizes-with the release store or CAS that published the
+    // pointee, so its contents are visible.
+    explicit Protected(const std::atomic<T *> &source)
+        : ptr(source.load(std::memory_order_acquire)) {
+        assert(Flavor::inReadSection());
+    }
+
+    T *operator->() const {
+        assert(Flavor::inReadSection());
+        return ptr;
+    }
+
+    T &operator*() const {
+        assert(Flavor::inReadSection());
+        return *ptr;
+    }
+
+    // Get the raw pointer, e.g. to compare it or hand it to discard.
+    //
+    // Dereferencing it is only safe for as long as the Protected is.
+    T *get() const {
+        return ptr;
+    }
+
+    explicit operator bool() const {
+        return ptr != nullptr;
+    }
+
+private:
+    T *ptr;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Deferred callbacks.
+//
+
+// An intrusive hook for deferring arbitrary work until after a grace period.
+//
+// Embed one in an RCU-protected object, and pass it to call along with a
+// function that recovers the object from it (e.g. using offsetof) and
+// disposes of it however it likes: delete it, drop a reference, return it to
+// a pool, and so on.
+struct CallbackHead {
+    CallbackHead *next;
+    void (*func)(CallbackHead *);
+};
+
+// Asynchronously invoke func(head) once a grace period has passed.
+//
+// That is, func is guaranteed not to run until every reader that was in a
+// read-side critical section when call was called has left it.
+//
+// Doesn't contend with calls on other threads: each thread queues its
+// callbacks on its own batch. A single shared reclaimer thread collects every
+// thread's batch, waits for one grace period covering all of them, and then
+// invokes them. Callbacks queued by a single thread are invoked in the order
+// they were queued.
+//
+// The reclaimer sleeps while every batch is empty. Lock-free, except that a
+// call that finds its thread's batch empty takes a lock to wake it.
+//
+// Callbacks run on the reclaimer thread. They may call call themselves, but
+// must not call barrier.
+//
+// Grace periods here are the default flavor's: callbacks may run while QSBR
+// readers are still online.
+//
+// Must be called from a registered thread.
+void call(CallbackHead *head, void (*func)(CallbackHead *));
+
+// Wait until every callback queued by call before barrier was called has
+// been invoked.
+//
+// Useful before destroying anything that pending callbacks refer to.
+void barrier(void);
+
+//////////////////////////////////////////////////////////////////////////////
+// Per-thread storage.
+//
+
+// One T for each registered thread, indexed by thread index.
+//
+// Ts are allocated, value-initialized, in chunks of THREADS_PER_CHUNK the
+// first time a thread in a chunk asks for its T. They are only destroyed
+// along with the PerThread, so a thread that reuses an index inherits
+// whatever the index's previous owner left in its T.
+template<typename T>
+class PerThread {
+public:
+    constexpr PerThread() : chunks() {}
+
+    PerThread(const PerThread &) = delete;
+    PerThread &operator=(const PerThread &) = delete;
+
+    ~PerThread() {
+        for (auto &chunk: chunks) {
+            delete[] chunk.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Get the current thread's T, allocating it if necessary.
+    //
+    // Must be called from a registered thread.
+    T &local(void) {
+        return get(currentThreadIndex());
+    }
+
+    // Get the T for the given thread index, allocating it if necessary.
+    T &get(unsigned idx) {
+        auto &chunk = chunks[idx / THREADS_PER_CHUNK];
+        auto ts = chunk.load(std::memory_order_acquire);
+
+        if (ts == nullptr) {
+            auto newTs = new T[THREADS_PER_CHUNK]();
+            // Synchronizes-with the acquire load above, so other threads see
+            // the initialized Ts.
+            if (chunk.compare_exchange_strong(ts, newTs,
+                        std::memory_order_acq_rel)) {
+                ts = newTs;
+            } else {
+                delete[] newTs;
+            }
+        }
+
+        return ts[idx % THREADS_PER_CHUNK];
+    }
+
+    // Get the T for the given thread index, or nullptr if it hasn't been
+    // allocated yet.
+    T *peek(unsigned idx) {
+        auto ts = chunks[idx / THREADS_PER_CHUNK].load(
+                std::memory_order_acquire);
+        return ts == nullptr ? nullptr : &ts[idx % THREADS_PER_CHUNK];
+    }
+
+    // Call f on every T allocated so far.
+    template<typename F>
+    void forEach(F f) {
+        for (auto &chunk: chunks) {
+            auto ts = chunk.load(std::memory_order_acquire);
+            if (ts == nullptr) continue;
+
+            for (unsigned i = 0; i < THREADS_PER_CHUNK; ++i) {
+                f(ts[i]);
+            }
+        }
+    }
+
+private:
+    std::atomic<T *> chunks[MAX_THREADS / THREADS_PER_CHUNK];
+};
+
 //////////////////////////////////////////////////////////////////////////////
 // Asynchronous garbage collection with RCU.
 //
 
+// What GarbageCollector::discard does once too many objects are pending.
+enum class Backpressure {
+    // Wait for the GC thread to get back under the limit.
+    BLOCK,
+    // Run a grace period and reclaim everything published so far on the
+    // calling thread.
+    SYNCHRONIZE,
+    // Just return false, so that the caller can back off.
+    REPORT,
+};
+
+// When a GarbageCollector's thread wakes up to reclaim memory, and how many
+// objects it may fall behind by.
+//
+// The GC thread sleeps until there is something to reclaim, and then until
+// either the pending objects cross one of the size thresholds or the oldest
+// of them has been waiting for maxDelay, whichever comes first. Objects count
+// as pending once their thread hands them to the GC thread (see discard).
+//
+// If a reader stalls, nothing gets reclaimed, so pending objects pile up
+// until they reach one of the limits, at which point discard applies
+// onLimit. The limits never wake the GC thread later than the thresholds
+// would.
+struct GcPolicy {
+    // Reclaim once this many bytes of objects are pending.
+    size_t maxPendingBytes = 1 << 20;
+    // Reclaim once this many objects are pending.
+    size_t maxPendingObjects = SIZE_MAX;
+    // Reclaim once anything has been pending for this long.
+    std::chrono::microseconds maxDelay = std::chrono::milliseconds(1);
+    // If non-negative, pin the GC thread to this CPU. Ignored when sharded.
+    int cpu = -1;
+    // Apply onLimit once this many bytes of objects are pending...
+    size_t pendingBytesLimit = SIZE_MAX;
+    // ...or this many objects.
+    size_t pendingObjectsLimit = SIZE_MAX;
+    Backpressure onLimit = Backpressure::BLOCK;
+    // How many shards to split reclamation into, each with its own GC thread
+    // pinned to a NUMA node, so that objects are freed by a thread local to
+    // the memory: 1 for a single unpinned GC thread, or 0 for one shard per
+    // node (see numaNodeCount). Objects go to the shard of their node, modulo
+    // the number of shards. Everything above applies to each shard
+    // separately.
+    unsigned shards = 1;
+};
+
 // Asynchronously deletes RCU-protected objects of type T.
-template<typename T>
+//
+// Objects are disposed of by calling a Deleter on them, so that they can be
+// returned to a pool rather than deleted (see NodePool). The GC hands objects
+// to its Deleter until it's joined, so a pool must outlive it, e.g. by being
+// declared before it. Grace periods are Flavor's.
+//
+// T must have a getGcNext() method returning a std::atomic<T *> & for the GC
+// to link objects through (see discard).
+//
+// If Deleter has a nodeOf(const T *) method returning the NUMA node that owns
+// an object's memory, as NodePool's does, sharded GCs route objects by it.
+// Otherwise they assume objects belong to the node of the thread discarding
+// them.
+template<typename T, typename Deleter = std::default_delete<T>,
+         typename Flavor = MembarrierFlavor>
 class GarbageCollector {
 public:
-    GarbageCollector()
-        : gcThread(gcLoop, this), head(nullptr), done(false) {}
+    GarbageCollector(GcPolicy policy = GcPolicy(), Deleter deleter = Deleter())
+        : limit(objectsFor(policy.pendingObjectsLimit,
+                           policy.pendingBytesLimit)),
+          threshold(std::min(limit, objectsFor(policy.maxPendingObjects,
+                                               policy.maxPendingBytes))),
+          policy(policy),
+          nShards(policy.shards == 0 ? numaNodeCount() : policy.shards),
+          shards(new Shard[nShards]), limitHits(0), deleter(deleter),
+          unregisterHook { flushCurrentThread, this } {
+        // The GC threads only start once the fields they read are
+        // initialized.
+        for (unsigned i = 0; i < nShards; ++i) {
+            shards[i].thread = std::thread(gcLoop, this, i);
+        }
+        addUnregisterHook(&unregisterHook);
+    }
 
-    // Wait until the GC thread is done, and then join it.
+    // Wait until the GC threads are done, and then join them.
+    //
+    // Then deletes anything still waiting to be deleted, including objects
+    // in the discard buffers of threads that are still registered. So by
+    // this point no thread may be calling discard.
     void join(void) {
-        done.store(true, std::memory_order_relaxed);
-        gcThread.join();
+        removeUnregisterHook(&unregisterHook);
+
+        for (unsigned i = 0; i < nShards; ++i) {
+            auto &shard = shards[i];
+            {
+                std::unique_lock lock(shard.wakeMutex);
+                shard.done = true;
+            }
+            shard.wakeup.notify_one();
+            shard.drained.notify_all();
+            shard.thread.join();
+        }
+
+        buffers.forEach([&](DiscardBuffer &buffer) { publish(buffer); });
+
+        for (unsigned i = 0; i < nShards; ++i) {
+            auto &shard = shards[i];
+            T *oldHead = shard.head.exchange(nullptr,
+                    std::memory_order_acquire);
+            if (oldHead != nullptr) {
+                reclaimed(shard, reclaim(oldHead));
+            }
+        }
     }
 
     // Asynchronously delete the given object.
     //
-    // A call to manager.synchronize() is guaranteed before the memory is
+    // A call to Flavor::synchronize() is guaranteed before the memory is
     // deleted.
     //
-    // Non-blocking. Places the given pointer in a shared collection, which is
-    // periodically cleared by the GC thread.
-    void discard(T *t) {
-        bool success;
+    // Non-blocking unless the GC is over its limit. Usually just links the
+    // object into a buffer private to this thread; every DISCARD_BATCH_SIZE
+    // objects, or when the thread unregisters, the buffer is handed to the
+    // GC thread. That only wakes the GC thread if it makes the GC thread's
+    // policy due. When sharded, the buffer is also handed over early if the
+    // object belongs to a different shard than the ones before it.
+    //
+    // If handing over the buffer leaves the pending objects at the policy's
+    // limit, applies its onLimit (see Backpressure). The limit is only
+    // checked then, once per batch, so that the rest of the time discard
+    // never touches memory other threads write. Returns whether we're back
+    // under the limit, which is always false for REPORT. In a read-side critical section, waiting
+    // for a grace period would deadlock, so there every policy acts like
+    // REPORT. The object is discarded either way.
+    //
+    // From here until t is deleted, its getGcNext belongs to the GC. Readers
+    // may still be traversing t until the grace period is up, so it must be
+    // a field of its own, not one they follow, like a list's next pointer.
+    //
+    // Must be called from a registered thread.
+    bool discard(T *t) {
+        auto &buffer = buffers.local();
+        route(buffer, t);
 
-        do {
-            // We use RCU protection to prevent the ABA problem.
-            readLock();
-            // Synchronizes-with committing CAS-es, to make sure that we read
-            // the updated next pointer.
-            T *oldHead = head.load(std::memory_order_acquire);
-            t->getGcNext().store(oldHead, std::memory_order_relaxed);
-            // Synchronizes-with reading next pointers, so that they always
-            // get the new value.
-            //
-            // This CAS is not subject to the ABA problem due to RCU
-            // protection. If the head at this CAS is equal to oldHead, either:
-            //
-            //   1. It has not been modified since we read it. This is fine.
-            //   2. Someone popped it off the stack, and then it eventually
-            //      got pushed back on.
-            //
-            // We always delete nodes after popping them, so in case (2) we
-            // must at some point have deleted oldHead. But this explicitly
-            // violates our RCU guarantees, so case (2) is impossible.
-            success = head.compare_exchange_weak(oldHead, t,
-                    std::memory_order_release);
-            readUnlock();
-        } while (!success);
+        t->getGcNext().store(buffer.first, std::memory_order_relaxed);
+        if (buffer.first == nullptr) {
+            buffer.last = t;
+        }
+        buffer.first = t;
+
+        if (++buffer.count == DISCARD_BATCH_SIZE) {
+            publish(buffer);
+            return checkLimit(shards[buffer.shard]);
+        }
+        return true;
+    }
+
+    // discard each of the count objects in the chain from first to last,
+    // which the caller has already linked through getGcNext. They all go to
+    // first's shard.
+    //
+    // Takes constant time, however long the chain is, unless it has to apply
+    // backpressure. Returns the same as discard.
+    bool discardChain(T *first, T *last, size_t count) {
+        auto &buffer = buffers.local();
+        route(buffer, first);
+
+        last->getGcNext().store(buffer.first, std::memory_order_relaxed);
+        if (buffer.first == nullptr) {
+            buffer.last = last;
+        }
+        buffer.first = first;
+
+        buffer.count += count;
+        if (buffer.count >= DISCARD_BATCH_SIZE) {
+            publish(buffer);
+            return checkLimit(shards[buffer.shard]);
+        }
+        return true;
+    }
+
+    // How many objects have been handed to the GC threads and not yet
+    // reclaimed, for monitoring. Doesn't count threads' discard buffers.
+    size_t pendingObjects(void) const {
+        size_t result = 0;
+        for (unsigned i = 0; i < nShards; ++i) {
+            result += shards[i].pending.load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+    // How many times discard has found the GC over its limit.
+    std::uint64_t limitHitCount(void) const {
+        return limitHits.load(std::memory_order_relaxed);
+    }
+
+    // How many shards, and so GC threads, there are.
+    unsigned shardCount(void) const {
+        return nShards;
     }
 
 private:
-    static void gcLoop(GarbageCollector *gc) {
-        using namespace std::literals;
+    // A chain of discarded objects, linked through getGcNext, that only one
+    // thread touches, all bound for the same shard.
+    //
+    // Padded to a cache line so that threads' buffers don't share one.
+    struct alignas(CACHE_LINE_BYTES) DiscardBuffer {
+        T *first;
+        T *last;
+        size_t count;
+        unsigned shard;
+    };
 
-        registerCurrentThread();
+    // A GC thread, and the objects waiting for it.
+    //
+    // Aligned so that the fields discarding threads write don't share a
+    // cache line with anything else.
+    struct alignas(CACHE_LINE_BYTES) Shard {
+        std::atomic<T *> head { nullptr };
+        // How many objects have been published to head and not yet deleted.
+        std::atomic<size_t> pending { 0 };
+        // When head last went from empty to not, in steady_clock
+        // nanoseconds, like statsClock. The GC thread's maxDelay counts
+        // from here.
+        std::atomic<std::uint64_t> headSince { 0 };
+        alignas(CACHE_LINE_BYTES) std::mutex wakeMutex;
+        // Wakes the GC thread.
+        std::condition_variable wakeup;
+        // Wakes threads blocked in applyBackpressure.
+        std::condition_variable drained;
+        // CAN ONLY BE READ OR MODIFIED WHILE HOLDING wakeMutex.
+        bool done = false;
+        std::thread thread;
+    };
 
-        // Loop until someone tells us to stop.
-        //
-        // We don't need any particular memory ordering guarantees on
-        // gc->done; we just need to eventually read any updates to it.
-        while (!gc->done.load(std::memory_order_relaxed)) {
-            T *oldHead;
-            bool success;
+    // Detects Deleters with a nodeOf method.
+    template<typename D>
+    static auto nodeOf(const D &d, const T *t, int) -> decltype(d.nodeOf(t)) {
+        return d.nodeOf(t);
+    }
 
-            {
-                do {
-                    // See the comments in discard for an explanation of how
-                    // this is synchronized.
-                    readLock();
-                    oldHead = gc->head.load(std::memory_order_acquire);
+    template<typename D>
+    static unsigned nodeOf(const D &, const T *, long) {
+        return currentNumaNode();
+    }
 
-                    if (oldHead == nullptr) break;
+    // Point buffer at t's shard, first handing over anything it holds for
+    // another one.
+    void route(DiscardBuffer &buffer, const T *t) {
+        if (nShards == 1) return;
 
-                    success = gc->head.compare_exchange_weak(oldHead, nullptr,
-                            std::memory_order_release);
-                    readUnlock();
-                } while(!success);
-            }
+        unsigned shard = nodeOf(deleter, t, 0) % nShards;
+        if (shard != buffer.shard) {
+            publish(buffer);
+            buffer.shard = shard;
+        }
+    }
+
+    // Hand the contents of a buffer to its shard's GC thread, leaving it
+    // empty.
+    void publish(DiscardBuffer &buffer) {
+        if (buffer.first == nullptr) return;
+        auto &shard = shards[buffer.shard];
+
+        // Count the objects before making them visible, so that the GC thread
+        // never subtracts them before we've added them.
+        auto oldPending = shard.pending.fetch_add(buffer.count,
+                std::memory_order_relaxed);
+        auto newPending = oldPending + buffer.count;
+
+        addStat(Stat::GC_PUBLISHED, buffer.count);
+
+        // The GC thread only ever takes the whole stack, so this CAS is not
+        // subject to the ABA problem.
+        T *oldHead = shard.head.load(std::memory_order_relaxed);
+        do {
+            buffer.last->getGcNext().store(oldHead,
+                    std::memory_order_relaxed);
+            // Synchronizes-with the exchange in gcLoop, so that it reads the
+            // updated next pointers.
+        } while (!shard.head.compare_exchange_weak(oldHead, buffer.first,
+                    std::memory_order_release, std::memory_order_relaxed));
+
+        // Whoever starts a new stack timestamps it, for maxDelay and
+        // RECLAIM_DELAY. Only once our CAS has won, so that we never
+        // overwrite the timestamp of a stack someone else started.
+        if (oldHead == nullptr) {
+            shard.headSince.store(steadyNanos(), std::memory_order_relaxed);
+        }
+
+        buffer.first = buffer.last = nullptr;
+        buffer.count = 0;
+
+        // Only wake the GC thread if it's sleeping until there's something
+        // to do, or until we cross the threshold. pending may be nonzero
+        // with head empty, while a thread in applyBackpressure reclaims what
+        // it took, so it's head going non-empty that counts.
+        if (oldHead == nullptr
+         || (oldPending < threshold && newPending >= threshold)) {
+            // Taking the lock makes sure the GC thread is either waiting or
+            // hasn't checked pending yet, so the notification can't be lost.
+            { std::unique_lock lock(shard.wakeMutex); }
+            shard.wakeup.notify_one();
+        }
+    }
+
+    static std::uint64_t steadyNanos(void) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // How many objects of type T fit in both limits, and at least 1.
+    static size_t objectsFor(size_t objects, size_t bytes) {
+        return std::max<size_t>(1, std::min(objects, bytes / sizeof(T)));
+    }
+
+    bool checkLimit(Shard &shard) {
+        if (__builtin_expect(
+                shard.pending.load(std::memory_order_relaxed) < limit, 1)) {
+            return true;
+        }
+        return applyBackpressure(shard);
+    }
+
+    // The slow path of checkLimit.
+    bool applyBackpressure(Shard &shard) {
+        limitHits.fetch_add(1, std::memory_order_relaxed);
+
+        if (policy.onLimit == Backpressure::REPORT
+         || Flavor::inReadSection()) {
+            return false;
+        }
 
-            // If the stack was empty, sleep for a while and then poll it
-            // again.
-            if (oldHead == nullptr) {
-                std::this_thread::sleep_for(1ms);
-                continue;
+        if (policy.onLimit == Backpressure::SYNCHRONIZE) {
+            // As in gcLoop. If the GC thread already took everything, we
+            // can't help it, but can still wait out a grace period, which
+            // is what it's waiting for too.
+            T *oldHead = shard.head.exchange(nullptr,
+                    std::memory_order_acquire);
+            if (oldHead != nullptr) {
+                reclaimed(shard, reclaim(oldHead));
+            } else {
+                Flavor::synchronize();
             }
+            return shard.pending.load(std::memory_order_relaxed) < limit;
+        }
 
-            // We've acquired the entire list! Now we need to synchronize,
-            // then free it.
+        // We're over the threshold too, so the GC thread is already awake.
+        std::unique_lock lock(shard.wakeMutex);
+        shard.drained.wait(lock, [&] {
+            return shard.done
+                || shard.pending.load(std::memory_order_relaxed) < limit;
+        });
+        return true;
+    }
+
+    // Stop counting count reclaimed objects as pending, waking anyone
+    // blocked in applyBackpressure if that gets the shard back under the
+    // limit.
+    void reclaimed(Shard &shard, size_t count) {
+        addStat(Stat::GC_RECLAIMED, count);
+        addStat(Stat::GC_RECLAIM_PASSES);
+
+        auto oldPending = shard.pending.fetch_sub(count,
+                std::memory_order_relaxed);
+        if (oldPending >= limit && oldPending - count < limit) {
+            // As in publish.
+            { std::unique_lock lock(shard.wakeMutex); }
+            shard.drained.notify_all();
+        }
+    }
+
+    static void flushCurrentThread(void *arg) {
+        auto gc = static_cast<GarbageCollector *>(arg);
+        auto buffer = gc->buffers.peek(currentThreadIndex());
 
-            synchronize();
+        if (buffer != nullptr) {
+            gc->publish(*buffer);
+        }
+    }
+
+    // Wait for a grace period, then delete the given chain of objects.
+    //
+    // Returns how many objects were deleted.
+    size_t reclaim(T *cur) {
+        // The default flavor's lazy grace period: there's no hurry, and it
+        // spares readers the IPIs.
+        Flavor::synchronize();
+
+        size_t count = 0;
+        while (cur != nullptr) {
+            T *next = cur->getGcNext().load(std::memory_order_relaxed);
+            cur->getGcNext().store(nullptr, std::memory_order_relaxed);
+            deleter(cur);
+            cur = next;
+            count++;
+        }
+
+        return count;
+    }
 
-            T *cur = oldHead;
-            while (cur != nullptr) {
-                T *next = cur->getGcNext().load(std::memory_order_relaxed);
-                cur->getGcNext().store(nullptr, std::memory_order_relaxed);
-                delete cur;
-                cur = next;
+    static void gcLoop(GarbageCollector *gc, unsigned idx) {
+        auto &shard = gc->shards[idx];
+
+        if (gc->nShards > 1) {
+            // Shard idx gets the objects of every node that's idx modulo
+            // the shard count; the first of them is as good as any.
+            pinToNumaNode(idx);
+        } else if (gc->policy.cpu >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(gc->policy.cpu, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+
+        registerCurrentThread();
+
+        while (true) {
+            std::uint64_t since;
+            {
+                std::unique_lock lock(shard.wakeMutex);
+
+                // pending also counts whatever applyBackpressure has taken
+                // off head and is still reclaiming, which we can't help
+                // with, so we only wake for what's on head. Otherwise we'd
+                // spin for as long as its grace period took.
+                auto anyPending = [&] {
+                    return shard.done || shard.head.load(
+                            std::memory_order_relaxed) != nullptr;
+                };
+                auto due = [&] {
+                    return shard.done || (anyPending() && shard.pending.load(
+                            std::memory_order_relaxed) >= gc->threshold);
+                };
+
+                // Sleep until there's something to reclaim, and then until
+                // it's time to reclaim it: maxDelay after the oldest of it
+                // arrived, however long our last pass took. join deals with
+                // anything left once we're done.
+                shard.wakeup.wait(lock, anyPending);
+                // Read before taking head, so that a stack published after
+                // we take it can't lend us its timestamp.
+                since = shard.headSince.load(std::memory_order_relaxed);
+                std::chrono::steady_clock::time_point deadline {
+                        std::chrono::nanoseconds(since) };
+                shard.wakeup.wait_until(lock,
+                                        deadline + gc->policy.maxDelay, due);
+
+                if (shard.done) break;
             }
+
+            // Synchronizes-with the committing CAS in publish.
+            T *oldHead = shard.head.exchange(nullptr,
+                    std::memory_order_acquire);
+
+            // applyBackpressure may have beaten us to it.
+            if (oldHead == nullptr) continue;
+
+            // We've acquired the entire list! Now we need to synchronize,
+            // then free it.
+            gc->reclaimed(shard, gc->reclaim(oldHead));
+            recordLatency(Latency::RECLAIM_DELAY, statsClock() - since);
         }
 
         unregisterCurrentThread();
     }
 
-    std::thread gcThread;
-    // Put padding around head to prevent false sharing.
-    std::byte padding1[CACHE_LINE_BYTES];
-    std::atomic<T *> head;
-    std::byte padding2[CACHE_LINE_BYTES];
-    std::atomic<bool> done;
+    // How many pending objects in a shard make discard apply backpressure,
+    // and how many make a reclamation due, from the policy.
+    const size_t limit;
+    const size_t threshold;
+    const GcPolicy policy;
+    const unsigned nShards;
+    std::unique_ptr<Shard[]> shards;
+    std::atomic<std::uint64_t> limitHits;
+    Deleter deleter;
+    PerThread<DiscardBuffer> buffers;
+    UnregisterHook unregisterHook;
 };
 
 //////////////////////////////////////////////////////////////////////////////
 // Shared global variables.
 //
 
-// Every thread that registers to use RCU has a PerThreadEntry in its 
-struct PerThreadEntry  {
+// Every thread that registers to use RCU has a PerThreadEntry in the
+// registry.
+//
+// Padded to a cache line, so that one thread's counter never shares a line
+// with another thread's, or with anything else.
+struct alignas(CACHE_LINE_BYTES) PerThreadEntry {
     std::atomic<std::uint64_t> gracePeriodCounter;
+    // The value of qsbrGracePeriod at this thread's last quiescent state, or
+    // 0 while it's offline.
+    std::atomic<std::uint64_t> qsbrCounter;
+    // Callbacks this thread has queued with call, most recent first. Pushed
+    // by this thread; taken all at once by the reclaimer.
+    std::atomic<CallbackHead *> callbacks;
+    // See currentThreadIndex.
+    unsigned index;
+    // The registered thread's kernel thread ID, for stall reports.
+    std::atomic<pid_t> tid;
+    // For the SIGNAL mechanism, the thread to signal, and whether it can be
+    // signaled, i.e. is registered.
+    //
+    // CAN ONLY BE READ OR MODIFIED WHILE HOLDING THE SIGNAL MUTEX IN RCU.cc.
+    pthread_t thread;
+    bool signalable;
 };
 
-static thread_local PerThreadEntry threadLocalEntry;
+// The current thread's entry in the registry, or nullptr if the thread isn't
+// registered.
+//
+// This is the only thread-local the reader fast path touches. Define
+// RCU_INITIAL_EXEC_TLS (or configure with -DRCU_INITIAL_EXEC_TLS=ON) to use
+// the initial-exec TLS model for it, which turns the __tls_get_addr call
+// position-independent code otherwise needs into a single %fs-relative load.
+// Only do this if RCU is linked into the executable, or into a library loaded
+// at startup rather than with dlopen. It must be defined the same way in
+// every translation unit.
+#ifdef RCU_INITIAL_EXEC_TLS
+#define RCU_TLS_MODEL __attribute__((tls_model("initial-exec")))
+#else
+#define RCU_TLS_MODEL
+#endif
 
-// The registry and globalGracePeriod mutex.
-static std::mutex mutex;
+inline thread_local PerThreadEntry *threadLocalEntry RCU_TLS_MODEL = nullptr;
 
 // Contains the grace period in a single bit. Also contains a 1 in the low
 // bit, so that reader threads can simultaneously read the grace period
 // and set their nesting to 1.
 //
-// CAN ONLY BE MODIFIED WHILE HOLDING rcu::mutex. Reader threads atomically
-// read this without holding mutex.
-static std::atomic<std::uint64_t> globalGracePeriod = 1;
+// CAN ONLY BE MODIFIED WHILE HOLDING THE GRACE-PERIOD MUTEX IN RCU.cc.
+// Reader threads atomically read this without holding it.
+inline std::atomic<std::uint64_t> globalGracePeriod = 1;
+
+// Whether readers must run real memory barriers, i.e. the FENCE mechanism is
+// active.
+//
+// Only written by registerCurrentProcess, before any other thread uses RCU.
+inline bool readerFences = false;
+
+// Set to -1 by synchronize when it is about to park waiting for readers, and
+// 0 otherwise. Readers leaving their outermost critical section only ever
+// load this; they wake the synchronizer if and only if it is -1.
+//
+// CAN ONLY BE SET TO -1 WHILE HOLDING THE GRACE-PERIOD MUTEX IN RCU.cc.
+inline std::atomic<std::int32_t> gpFutex = 0;
 
-// The thread registry.
+// The QSBR grace-period number. Never 0, which means offline.
 //
-// CAN ONLY BE READ OR MODIFIED WHILE HOLDING rcu::mutex.
-static std::list<PerThreadEntry *> entries;
+// Only ever incremented, by QsbrFlavor::synchronize.
+inline std::atomic<std::uint64_t> qsbrGracePeriod = 1;
+
+// Wake up a synchronizer parked on gpFutex.
+//
+// The slow path of readUnlock; not part of the public interface.
+void wakeSynchronizer(void);
 
 //////////////////////////////////////////////////////////////////////////////
 // Reader-side inline function implementations.
 //
 
+inline unsigned currentThreadIndex(void) {
+    return threadLocalEntry->index;
+}
+
+inline void cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+// The barrier readers run at the start of their critical sections: a compiler
+// barrier, unless the FENCE mechanism needs a memory barrier.
+inline void readerBarrier(void) {
+    if (__builtin_expect(readerFences, 0)) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    } else {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+}
+
+// The barrier readers run at the end of their critical sections, which only
+// has to order their reads before the store that leaves. x86 never reorders
+// those, so there it's always just a compiler barrier.
+inline void readerReleaseBarrier(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#else
+    readerBarrier();
+#endif
+}
+
+inline PerThreadEntry *currentThreadEntry(void) {
+    return threadLocalEntry;
+}
+
+inline bool inReadSection(void) {
+    auto self = threadLocalEntry;
+    return self != nullptr
+        && (self->gracePeriodCounter.load(std::memory_order_relaxed)
+            & NESTING_MASK);
+}
+
 inline void readLock(void) {
-    auto tmp = threadLocalEntry.gracePeriodCounter.load(
-            std::memory_order_relaxed);
+    readLock(threadLocalEntry);
+}
+
+inline void readUnlock(void) {
+    readUnlock(threadLocalEntry);
+}
+
+inline void readLock(PerThreadEntry *self) {
+    auto tmp = self->gracePeriodCounter.load(std::memory_order_relaxed);
     // If our nesting is currently 0,
     if (!(tmp & NESTING_MASK)) {
         // Simultaneously set nesting to 1 and read the current grace
         // period.
         auto global = globalGracePeriod.load(std::memory_order_relaxed);
-        threadLocalEntry.gracePeriodCounter.store(global,
-                std::memory_order_relaxed);
-        // This "memory barrier" should compile to nothing.
+        self->gracePeriodCounter.store(global, std::memory_order_relaxed);
+        // This "memory barrier" compiles to nothing (except with the FENCE
+        // mechanism); it only stops the compiler from moving reads of shared
+        // data above the store.
         //
-        // It's here because the first membarrierAllThreads call in
-        // synchronize effectively synchronizes-with this "memory barrier"
-        // to ensure that the start of our read-side critical section
-        // happens-before any reads of shared data.
-        std::atomic_thread_fence(std::memory_order_relaxed);
+        // It's here because the first fenceAllThreads call in synchronize
+        // effectively synchronizes-with this "memory barrier" to ensure that
+        // the start of our read-side critical section happens-before any
+        // reads of shared data.
+        readerBarrier();
     } else {
         // Increment our nesting.
-        threadLocalEntry.gracePeriodCounter.store(tmp + 1,
-                std::memory_order_relaxed);
+        self->gracePeriodCounter.store(tmp + 1, std::memory_order_relaxed);
     }
 }
 
-inline void readUnlock(void) {
-    // Like the barrier in read-lock, this is essentially here for
-    // documentation.
+inline void readUnlock(PerThreadEntry *self) {
+    // Like the barrier in read-lock, this usually compiles to nothing and
+    // only constrains the compiler.
     //
     // This barrier synchronizes-with the barrier at the start of
     // `synchronize` to ensure that all of our reads happen-before we
     // enter a quiescent state.
-    std::atomic_thread_fence(std::memory_order_relaxed);
+    readerReleaseBarrier();
 
     // Subtract one from our nesting.
-    auto tmp = threadLocalEntry.gracePeriodCounter.load(
-            std::memory_order_relaxed);
-    threadLocalEntry.gracePeriodCounter.store(tmp - 1,
-            std::memory_order_relaxed);
+    auto tmp = self->gracePeriodCounter.load(std::memory_order_relaxed);
+    self->gracePeriodCounter.store(tmp - 1, std::memory_order_relaxed);
+
+    // If we just left our outermost critical section, a synchronizer may be
+    // parked waiting for us.
+    if (!((tmp - 1) & NESTING_MASK)) {
+        // Keep the compiler from hoisting the load above the store. The
+        // fenceAllThreads call synchronize makes after setting gpFutex
+        // orders them at the CPU level: either synchronize sees our store, or
+        // we see its -1. (With the FENCE mechanism, synchronize never parks,
+        // so this doesn't need a real barrier either.)
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        if (__builtin_expect(gpFutex.load(std::memory_order_relaxed) == -1,
+                             0)) {
+            wakeSynchronizer();
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// QSBR inline function implementations.
+//
+
+inline void threadOnline(void) {
+    auto self = threadLocalEntry;
+    self->qsbrCounter.store(qsbrGracePeriod.load(std::memory_order_acquire),
+                            std::memory_order_relaxed);
+    // Pairs with the fence in QsbrFlavor::synchronize: either it sees us
+    // online, or our reads from here on see everything it unlinked.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+inline void threadOffline(void) {
+    // Synchronizes-with the acquire loads in QsbrFlavor::synchronize, so
+    // that our reads happen-before it returns.
+    threadLocalEntry->qsbrCounter.store(0, std::memory_order_release);
+}
+
+inline void quiescentState(void) {
+    auto self = threadLocalEntry;
+    // The acquire synchronizes-with the grace period's increment, so that
+    // once we announce it, our reads see everything unlinked before it. The
+    // release synchronizes-with QsbrFlavor::synchronize, as in
+    // threadOffline.
+    self->qsbrCounter.store(qsbrGracePeriod.load(std::memory_order_acquire),
+                            std::memory_order_release);
+}
+
+inline bool isOnline(void) {
+    auto self = threadLocalEntry;
+    return self != nullptr
+        && self->qsbrCounter.load(std::memory_order_relaxed) != 0;
 }
 
 }
@@ -0,0 +1,148 @@
+// An RCU-protected concurrent HAMT set of strings.
+//
+// find walks an immutable version of the trie inside a read-side critical
+// section, so it never blocks or retries. insert and erase are serialized by
+// a mutex, and copy the path down to the key they change: each node on it is
+// replaced by a copy that shares all its other children with the original
+// (see HAMT.hh's copy-on-write constructors). The new version is published
+// with a single release store of the root, and the nodes it replaced are
+// retired with rcu::call, so readers still in the old version are unaffected.
+// Once their grace period is up, retired nodes go back to the trie's
+// HamtNodeArena.
+//
+// Since nothing reachable from a root is ever modified, every old root is a
+// complete point-in-time version of the set. snapshot pins the current one,
+// so it can be read for as long as needed without a read-side critical
+// section, and without holding up grace periods. Only the nodes a pinned
+// version can reach are held back from reclamation: each node records the
+// version that created it, and each retired batch the version that replaced
+// it, so a retired node is kept only while some pinned version falls in
+// between. diff compares two snapshots in time proportional to what changed
+// between them, skipping every subtree they share.
+//
+// All methods must be called from registered threads, except Snapshot's.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "HAMT.hh"
+
+struct RetiredHamtNodes;
+
+class RcuHamt {
+public:
+    using KeyCallback = std::function<void(std::string_view key)>;
+
+    // A pinned version of the set, which stays exactly as it was however the
+    // set changes afterwards.
+    //
+    // Reads need no critical section, so may take as long as they like, and
+    // may come from any thread, registered or not. Nodes the version needs
+    // are held back from reclamation until the Snapshot is destroyed, which
+    // must happen before the RcuHamt is.
+    class Snapshot {
+    public:
+        Snapshot(Snapshot &&other);
+        Snapshot &operator=(Snapshot &&other);
+
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+
+        ~Snapshot();
+
+        bool find(const std::string &str) const;
+
+        // Call f with every key, in no particular order.
+        void forEach(const KeyCallback &f) const;
+
+        // Which version of the set this is. Each insert or erase that
+        // changes the set makes a new version.
+        uint64_t version() const;
+
+    private:
+        friend class RcuHamt;
+
+        Snapshot(const RcuHamt *hamt, const TopLevelHamtNode *root);
+
+        // Unpin root, if we have one.
+        void reset();
+
+        const RcuHamt *hamt;
+        const TopLevelHamtNode *root;
+    };
+
+    RcuHamt();
+
+    RcuHamt(const RcuHamt &) = delete;
+    RcuHamt &operator=(const RcuHamt &) = delete;
+
+    // Must not race with any other method, and every Snapshot must already
+    // have been destroyed.
+    ~RcuHamt();
+
+    void insert(std::string &&str);
+    bool find(const std::string &str) const;
+    bool erase(const std::string &str);
+
+    // Set found[i] to find(keys[i]) for every i below nKeys. See
+    // Hamt::findBatch.
+    void findBatch(const std::string *keys, size_t nKeys, bool *found) const;
+
+    // Pin the current version.
+    Snapshot snapshot() const;
+
+    // Call onRemoved with every key in from but not to, and onAdded with
+    // every key in to but not from, in no particular order.
+    //
+    // Skips every subtree the two versions share, so it takes time
+    // proportional to how much changed between them rather than to their
+    // size. Both must be snapshots of the same RcuHamt.
+    static void diff(const Snapshot &from, const Snapshot &to,
+                     const KeyCallback &onRemoved,
+                     const KeyCallback &onAdded);
+
+    // How many retired nodes and leaves are being held back from
+    // reclamation for Snapshots. For monitoring.
+    size_t heldNodeCount() const;
+
+private:
+    friend struct RetiredHamtNodes;
+
+    // Replace oldRoot's entry at idx with entry, publish the result, and
+    // retire oldRoot along with everything in retired.
+    void publish(TopLevelHamtNode *oldRoot, unsigned idx, HamtNodeEntry entry,
+                 RetiredHamtNodes *retired);
+
+    // Unpin a Snapshot's version, and free whatever no other is holding.
+    void unpin(uint64_t version) const;
+
+    // Free what retired holds, once its grace period is up, except for
+    // nodes a pinned version can still reach.
+    void reclaim(RetiredHamtNodes *retired) const;
+
+    // Only allocated from under writeMutex. Declared before root, so that it
+    // outlives root's nodes.
+    HamtNodeArena arena;
+    std::atomic<TopLevelHamtNode *> root;
+    // Serializes insert and erase.
+    std::mutex writeMutex;
+    std::hash<std::string> hasher;
+
+    // Serializes everything below, which Snapshots update through const
+    // references.
+    mutable std::mutex snapshotMutex;
+    // How many Snapshots pin each version.
+    mutable std::map<uint64_t, unsigned> pinned;
+    // Retired batches some pinned version can still reach part of, trimmed
+    // to just those parts.
+    mutable std::vector<RetiredHamtNodes *> held;
+};
@@ -0,0 +1,368 @@
+// A resizable hash map synchronized with userspace RCU.
+//
+// Based on the relativistic hash tables of [1]. Lookups are wait-free, run
+// inside a read-side critical section, and never block, even while the table
+// is being resized. Writers are serialized by a mutex.
+//
+// Resizing never moves or copies a node. To grow, the writer publishes a
+// table with twice as many buckets, each pointing into the old chain that
+// holds its nodes, and then "unzips" each old chain into its two new ones one
+// link at a time, waiting for a grace period between steps so that no reader
+// is ever cut off from the rest of its bucket. To shrink, it appends each
+// pair of old chains and publishes the smaller table over them. Either way,
+// readers may see nodes from other buckets in their chain for a while, which
+// they skip, since they compare keys anyway.
+//
+// Keys are unique; insert doesn't overwrite an existing key.
+//
+// [1] J. Triplett, P. E. McKenney and J. Walpole, "Resizable, Scalable,
+//     Concurrent Hash Tables via Relativistic Programming," USENIX ATC 2011.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "NodePool.hh"
+#include "RCU.hh"
+
+//////////////////////////////////////////////////////////////////////////////
+// Constants.
+//
+
+// The table never shrinks below this many buckets.
+const size_t HASH_MAP_MIN_BUCKETS = 16;
+
+// Grow the table once there are more than this many entries per bucket...
+const size_t HASH_MAP_MAX_LOAD = 2;
+
+// ...and shrink it once there are fewer than one per this many buckets.
+const size_t HASH_MAP_MIN_LOAD_INVERSE = 4;
+
+//////////////////////////////////////////////////////////////////////////////
+// RcuHashMap.
+//
+
+template<typename K, typename V>
+struct RcuHashMapNode {
+    std::atomic<RcuHashMapNode *> next;
+    size_t hash;
+    K key;
+    V value;
+    // The GC's, once the node is unlinked (see GarbageCollector::discard).
+    std::atomic<RcuHashMapNode *> gcNext;
+
+    std::atomic<RcuHashMapNode *> &getGcNext(void) {
+        return gcNext;
+    }
+};
+
+template<typename K, typename V, typename Hash = std::hash<K>,
+         typename Flavor = rcu::MembarrierFlavor>
+class RcuHashMap {
+public:
+    // buckets is rounded up to a power of two, and to at least
+    // HASH_MAP_MIN_BUCKETS.
+    RcuHashMap(size_t buckets = HASH_MAP_MIN_BUCKETS,
+               rcu::GcPolicy policy = rcu::GcPolicy())
+        : table(createTable(roundBuckets(buckets))), count(0), pool(),
+          gc(policy, { &pool }) {}
+
+    RcuHashMap(const RcuHashMap &) = delete;
+    RcuHashMap &operator=(const RcuHashMap &) = delete;
+
+    // Destroy every entry still in the map.
+    //
+    // joinGC must already have been called.
+    ~RcuHashMap() {
+        auto cur = table.load(std::memory_order_relaxed);
+        for (size_t i = 0; i <= cur->mask; ++i) {
+            auto node = cur->buckets[i].load(std::memory_order_relaxed);
+            while (node != nullptr) {
+                auto next = node->next.load(std::memory_order_relaxed);
+                pool.destroy(node);
+                node = next;
+            }
+        }
+        destroyTable(cur);
+    }
+
+    void joinGC(void) {
+        gc.join();
+    }
+
+    // Add key, unless it's already there.
+    //
+    // Returns whether key was added. May grow the table, which waits for
+    // several grace periods, so must not be called in a read-side critical
+    // section.
+    bool insert(const K &key, const V &value) {
+        auto hash = hasher(key);
+
+        std::unique_lock lock(writeMutex);
+        // Only writers replace the table, and we hold the lock.
+        auto cur = table.load(std::memory_order_relaxed);
+        auto &bucket = cur->buckets[hash & cur->mask];
+
+        if (findInChain(bucket, hash, key) != nullptr) {
+            return false;
+        }
+
+        auto node = pool.create(bucket.load(std::memory_order_relaxed), hash,
+                                key, value, nullptr);
+        // Synchronizes-with the acquire loads in find, so that readers see
+        // node fully constructed.
+        bucket.store(node, std::memory_order_release);
+
+        auto newCount = count.load(std::memory_order_relaxed) + 1;
+        count.store(newCount, std::memory_order_relaxed);
+        if (newCount > (cur->mask + 1) * HASH_MAP_MAX_LOAD) {
+            grow();
+        }
+
+        return true;
+    }
+
+    // Remove key, if it's there.
+    //
+    // Returns whether key was removed. May shrink the table; see insert.
+    bool erase(const K &key) {
+        auto hash = hasher(key);
+
+        std::unique_lock lock(writeMutex);
+        auto cur = table.load(std::memory_order_relaxed);
+        std::atomic<Node *> *link = &cur->buckets[hash & cur->mask];
+
+        while (true) {
+            auto node = link->load(std::memory_order_relaxed);
+            if (node == nullptr) return false;
+
+            if (node->hash == hash && node->key == key) {
+                // Readers already on node can still follow its next pointer,
+                // which we leave alone.
+                link->store(node->next.load(std::memory_order_relaxed),
+                            std::memory_order_release);
+                gc.discard(node);
+                break;
+            }
+            link = &node->next;
+        }
+
+        auto newCount = count.load(std::memory_order_relaxed) - 1;
+        count.store(newCount, std::memory_order_relaxed);
+        if (cur->mask + 1 > HASH_MAP_MIN_BUCKETS
+         && newCount * HASH_MAP_MIN_LOAD_INVERSE < cur->mask + 1) {
+            shrink();
+        }
+
+        return true;
+    }
+
+    bool contains(const K &key) const {
+        auto hash = hasher(key);
+
+        rcu::BasicReadGuard<Flavor> guard;
+        rcu::Protected<Table *, Flavor> cur(table);
+        return findInChain(cur->buckets[hash & cur->mask], hash, key)
+            != nullptr;
+    }
+
+    // Copy key's value into value, if key is there.
+    //
+    // Returns whether it was there.
+    bool find(const K &key, V &value) const {
+        auto hash = hasher(key);
+
+        rcu::BasicReadGuard<Flavor> guard;
+        rcu::Protected<Table *, Flavor> cur(table);
+        auto node = findInChain(cur->buckets[hash & cur->mask], hash, key);
+        if (node == nullptr) {
+            return false;
+        }
+
+        value = node->value;
+        return true;
+    }
+
+    size_t size(void) const {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    // How many buckets the current table has.
+    size_t bucketCount(void) const {
+        rcu::BasicReadGuard<Flavor> guard;
+        rcu::Protected<Table *, Flavor> cur(table);
+        return cur->mask + 1;
+    }
+
+private:
+    using Node = RcuHashMapNode<K, V>;
+
+    // A bucket array. Variable-size, with mask + 1 buckets.
+    struct Table {
+        size_t mask;
+        std::atomic<Node *> buckets[1];
+    };
+
+    static size_t roundBuckets(size_t buckets) {
+        size_t result = HASH_MAP_MIN_BUCKETS;
+        while (result < buckets) {
+            result *= 2;
+        }
+        return result;
+    }
+
+    static Table *createTable(size_t buckets) {
+        auto mem = ::operator new(
+                sizeof(Table) + (buckets - 1) * sizeof(std::atomic<Node *>));
+        auto result = new (mem) Table { buckets - 1, { { nullptr } } };
+        for (size_t i = 1; i < buckets; ++i) {
+            new (&result->buckets[i]) std::atomic<Node *>(nullptr);
+        }
+        return result;
+    }
+
+    static void destroyTable(Table *t) {
+        ::operator delete(t);
+    }
+
+    // Find key in the chain starting at bucket, skipping nodes that belong
+    // to other buckets mid-resize.
+    //
+    // Must be called in a read-side critical section, or by a writer (which
+    // is why this doesn't use rcu::Protected).
+    static Node *findInChain(const std::atomic<Node *> &bucket, size_t hash,
+                             const K &key) {
+        // These loads synchronize-with the release stores that publish
+        // nodes.
+        for (auto cur = bucket.load(std::memory_order_acquire);
+             cur != nullptr;
+             cur = cur->next.load(std::memory_order_acquire)) {
+            if (cur->hash == hash && cur->key == key) {
+                return cur;
+            }
+        }
+        return nullptr;
+    }
+
+    // Double the number of buckets. Must hold writeMutex.
+    void grow(void) {
+        auto oldTable = table.load(std::memory_order_relaxed);
+        auto oldBuckets = oldTable->mask + 1;
+        auto newTable = createTable(oldBuckets * 2);
+        auto newMask = newTable->mask;
+
+        // Where we are in each old chain: some node in a run of nodes that
+        // all belong in the same new bucket. We start at the old heads.
+        std::vector<Node *> cursors;
+        for (size_t i = 0; i < oldBuckets; ++i) {
+            cursors.push_back(oldTable->buckets[i].load(
+                    std::memory_order_relaxed));
+        }
+
+        // Point each new bucket at the first node of its own in the old chain
+        // it's coming from.
+        for (size_t i = 0; i <= newMask; ++i) {
+            auto node = cursors[i & oldTable->mask];
+            while (node != nullptr && (node->hash & newMask) != i) {
+                node = node->next.load(std::memory_order_relaxed);
+            }
+            newTable->buckets[i].store(node, std::memory_order_relaxed);
+        }
+
+        table.store(newTable, std::memory_order_release);
+        // Once no-one can still be using the old table, we can free it, and
+        // start untangling the chains, which then no longer have to hold
+        // both halves of each old bucket.
+        Flavor::synchronize();
+        destroyTable(oldTable);
+
+        // Each pass cuts at most one foreign run out of each chain, and then
+        // waits for readers who might have been in it.
+        bool anyLeft = true;
+        while (anyLeft) {
+            anyLeft = false;
+
+            for (auto &cursor: cursors) {
+                if (cursor == nullptr) continue;
+                cursor = unzipStep(cursor, newMask);
+                anyLeft |= cursor != nullptr;
+            }
+
+            if (anyLeft) Flavor::synchronize();
+        }
+    }
+
+    // Make the run of nodes containing cur skip the run after it, which
+    // belongs to the other bucket.
+    //
+    // Returns the start of the run we skipped, where the next step picks up,
+    // or nullptr if there was nothing left to skip.
+    static Node *unzipStep(Node *cur, size_t mask) {
+        auto bucket = cur->hash & mask;
+
+        auto next = cur->next.load(std::memory_order_relaxed);
+        while (next != nullptr && (next->hash & mask) == bucket) {
+            cur = next;
+            next = cur->next.load(std::memory_order_relaxed);
+        }
+        if (next == nullptr) return nullptr;
+
+        auto resume = next;
+        while (resume != nullptr && (resume->hash & mask) != bucket) {
+            resume = resume->next.load(std::memory_order_relaxed);
+        }
+
+        // Readers of the other bucket can only be on cur if they got there
+        // before the last grace period, when the chains were still joined.
+        // Now they're all past it, and readers of ours skip straight to our
+        // next node.
+        cur->next.store(resume, std::memory_order_release);
+        return next;
+    }
+
+    // Halve the number of buckets. Must hold writeMutex.
+    void shrink(void) {
+        auto oldTable = table.load(std::memory_order_relaxed);
+        auto newBuckets = (oldTable->mask + 1) / 2;
+        auto newTable = createTable(newBuckets);
+
+        for (size_t i = 0; i < newBuckets; ++i) {
+            auto first = oldTable->buckets[i].load(std::memory_order_relaxed);
+            auto second = oldTable->buckets[i + newBuckets].load(
+                    std::memory_order_relaxed);
+
+            if (first == nullptr) {
+                newTable->buckets[i].store(second, std::memory_order_relaxed);
+                continue;
+            }
+
+            // Readers of the old first bucket will see second's nodes, but
+            // skip them.
+            auto last = first;
+            while (auto next = last->next.load(std::memory_order_relaxed)) {
+                last = next;
+            }
+            last->next.store(second, std::memory_order_release);
+            newTable->buckets[i].store(first, std::memory_order_relaxed);
+        }
+
+        table.store(newTable, std::memory_order_release);
+        Flavor::synchronize();
+        destroyTable(oldTable);
+    }
+
+    std::atomic<Table *> table;
+    // Only written under writeMutex.
+    std::atomic<size_t> count;
+    Hash hasher;
+    std::mutex writeMutex;
+    rcu::NodePool<Node> pool;
+    rcu::GarbageCollector<Node, typename rcu::NodePool<Node>::Deleter,
+                          Flavor> gc;
+};
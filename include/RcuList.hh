@@ -1,20 +1,65 @@
+// A lock-free stack synchronized with userspace RCU.
+//
+// Under contention, push and pop back off to an elimination array, after [1]:
+// a push that fails its CAS on head offers its node in a random slot for a
+// while, and a pop that fails its CAS takes any node it finds offered there.
+// The pair cancels out without touching head. Each thread only starts using
+// the array once its CAS-es have been failing for a while, so uncontended
+// operations never look at it.
+//
+// [1] D. Hendler, N. Shavit and L. Yerushalmi, "A Scalable Lock-free Stack
+//     Algorithm," SPAA 2004.
+//
+
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include "NodePool.hh"
 #include "RCU.hh"
+#include "SimdSearch.hh"
+
+//////////////////////////////////////////////////////////////////////////////
+// Constants.
+//
+
+// How many slots each list's elimination array has.
+const size_t LIST_ELIMINATION_SLOTS = 8;
+
+// How many times a push checks whether its offer was taken (with a CPU pause
+// between checks) before withdrawing it.
+const unsigned LIST_ELIMINATION_SPINS = 64;
+
+// Each failed CAS on head adds 2 to a thread's contention score, up to this
+// maximum, and each push or pop that goes through after failing takes away
+// 3, so that one that only had to retry once lowers it. Uncontended pushes
+// and pops never touch it...
+const unsigned LIST_CONTENTION_MAX = 16;
+
+// ...and threads with at least this score use the elimination array.
+const unsigned LIST_ELIMINATION_THRESHOLD = 4;
+
+//////////////////////////////////////////////////////////////////////////////
+// RcuList.
+//
 
 struct RcuListNode {
     std::atomic<RcuListNode *> next;
     std::uint64_t data;
+    // Links the node for the GC (see GarbageCollector::discard).
+    std::atomic<RcuListNode *> gcNext;
 
     std::atomic<RcuListNode *> &getGcNext(void) {
-        return next;
+        return gcNext;
     }
 };
 
-class RcuList {
+// Flavor is the RCU flavor its readers and writers use (see RCU.hh).
+template<typename Flavor = rcu::MembarrierFlavor>
+class BasicRcuList {
 public:
-    RcuList() : head(nullptr), gc() {}
+    BasicRcuList(rcu::GcPolicy policy = rcu::GcPolicy())
+        : head(nullptr), pool(), gc(policy, { &pool }) {}
 
     void joinGC(void) {
         gc.join();
@@ -23,15 +68,17 @@ public:
     uint64_t pop() {
         RcuListNode *oldHead;
         bool success;
+        bool failed = false;
 
         do {
             // Use RCU for ABA protection.
-            rcu::readLock();
+            rcu::BasicReadGuard<Flavor> guard;
             // This load synchronizes-with committing CAS-es, so that we
             // always read the updated next pointer.
-            oldHead = head.load(std::memory_order_acquire);
+            rcu::Protected<RcuListNode *, Flavor> protectedHead(head);
+            oldHead = protectedHead.get();
             if (oldHead == nullptr) break;
-            RcuListNode *newHead = oldHead->next.load(
+            RcuListNode *newHead = protectedHead->next.load(
                 std::memory_order_relaxed);
             // Synchronizes-with reading next pointers, so that they always
             // get the new value.
@@ -48,8 +95,16 @@ public:
             // violates our RCU guarantees, so case (2) is impossible.
             success = head.compare_exchange_weak(oldHead, newHead, 
                 std::memory_order_release);
-            rcu::readUnlock();
+
+            if (!success) {
+                failed = true;
+                if (casFailed()) {
+                    oldHead = tryEliminatePop();
+                    success = oldHead != nullptr;
+                }
+            }
         } while (!success);
+        if (failed) contendedDone();
 
         if (oldHead == nullptr) {
             return 0xDEAD;
@@ -63,43 +118,237 @@ public:
     }
 
     void push(std::uint64_t data) {
-        auto newNode = new RcuListNode {
-            nullptr,
-            data
-        };
+        auto newNode = pool.create(nullptr, data, nullptr);
 
         bool success;
+        bool failed = false;
         do {
             // See the comments in pop for an explanation of how
             // this is synchronized.
-            rcu::readLock();
+            rcu::BasicReadGuard<Flavor> guard;
             RcuListNode *old = head.load(std::memory_order_acquire);
             newNode->next.store(old, std::memory_order_relaxed);
             success = head.compare_exchange_weak(old, newNode,
                 std::memory_order_release);
-            rcu::readUnlock();
+
+            if (!success) {
+                failed = true;
+                if (casFailed()) {
+                    success = tryEliminatePush(newNode);
+                }
+            }
+        } while (!success);
+        if (failed) contendedDone();
+    }
+
+    // Push every value in [begin, end), in order, so that the last one ends up
+    // on top.
+    //
+    // The values are linked into a chain first, which then goes on with a
+    // single CAS.
+    template<typename Iterator>
+    void pushBatch(Iterator begin, Iterator end) {
+        if (begin == end) return;
+
+        RcuListNode *bottom = pool.create(nullptr, *begin, nullptr);
+        RcuListNode *top = bottom;
+        for (++begin; begin != end; ++begin) {
+            top = pool.create(top, *begin, nullptr);
+        }
+
+        bool success;
+        do {
+            // As in push.
+            rcu::BasicReadGuard<Flavor> guard;
+            RcuListNode *old = head.load(std::memory_order_acquire);
+            bottom->next.store(old, std::memory_order_relaxed);
+            success = head.compare_exchange_weak(old, top,
+                std::memory_order_release);
+            if (!success) rcu::addStat(rcu::Stat::LIST_CAS_RETRIES);
         } while (!success);
     }
 
+    // Pop up to n values into out, top first.
+    //
+    // Detaches them with a single CAS, and discards them all at once.
+    // Returns how many values were popped, which is less than n only if the
+    // list ran out.
+    size_t popBatch(size_t n, std::uint64_t *out) {
+        if (n == 0) return 0;
+
+        RcuListNode *first;
+        size_t count;
+        bool success;
+
+        do {
+            // As in pop, RCU keeps every node we walk over here from being
+            // reused, which rules out ABA.
+            rcu::BasicReadGuard<Flavor> guard;
+            rcu::Protected<RcuListNode *, Flavor> protectedHead(head);
+            first = protectedHead.get();
+            if (first == nullptr) return 0;
+
+            RcuListNode *cur = first;
+            count = 1;
+            RcuListNode *newHead = cur->next.load(std::memory_order_acquire);
+            while (count < n && newHead != nullptr) {
+                cur = newHead;
+                count++;
+                newHead = cur->next.load(std::memory_order_acquire);
+            }
+
+            success = head.compare_exchange_weak(first, newHead,
+                std::memory_order_release);
+            if (!success) rcu::addStat(rcu::Stat::LIST_CAS_RETRIES);
+        } while (!success);
+
+        // The chain is ours now. Its next pointers never change, and readers
+        // may still follow them, so it's linked for the GC through gcNext.
+        RcuListNode *cur = first;
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = cur->data;
+            auto next = cur->next.load(std::memory_order_relaxed);
+            if (i + 1 < count) {
+                cur->gcNext.store(next, std::memory_order_relaxed);
+                cur = next;
+            }
+        }
+
+        gc.discardChain(first, cur, count);
+        return count;
+    }
+
     bool search(std::uint64_t data) {
-        rcu::readLock();
+        rcu::BasicReadGuard<Flavor> guard;
 
-        for (RcuListNode *cur = head.load(std::memory_order_acquire);
-             cur != nullptr;
-             cur = cur->next.load(std::memory_order_acquire)) {
+        for (rcu::Protected<RcuListNode *, Flavor> cur(head);
+             cur;
+             cur = rcu::Protected<RcuListNode *, Flavor>(cur->next)) {
             if (cur->data == data) {
-                rcu::readUnlock();
                 return true;
             }
         }
 
-        rcu::readUnlock();
-
         return false;
     }
 
+    // Set found[i] to search(values[i]) for every i below n.
+    //
+    // Makes a single pass over the list, in a single read-side critical
+    // section, stopping once everything has been found.
+    void searchMany(const std::uint64_t *values, size_t n, bool *found) {
+        std::fill(found, found + n, false);
+        size_t remaining = n;
+
+        rcu::BasicReadGuard<Flavor> guard;
+
+        for (rcu::Protected<RcuListNode *, Flavor> cur(head);
+             cur && remaining > 0;
+             cur = rcu::Protected<RcuListNode *, Flavor>(cur->next)) {
+            auto data = cur->data;
+
+            // Most nodes match none of the values, which one vector scan of
+            // them rules out.
+            if (!rcu::containsValue(values, n, data)) continue;
+
+            for (size_t i = 0; i < n; ++i) {
+                if (!found[i] && values[i] == data) {
+                    found[i] = true;
+                    remaining--;
+                }
+            }
+        }
+    }
+
 private:
+    // A slot in the elimination array, holding a pushed node on offer, or
+    // nullptr. Padded so that slots don't share cache lines.
+    struct alignas(rcu::CACHE_LINE_BYTES) EliminationSlot {
+        std::atomic<RcuListNode *> offer { nullptr };
+    };
+
+    // The calling thread's contention score, shared by every list.
+    static unsigned &contention(void) {
+        thread_local unsigned score = 0;
+        return score;
+    }
+
+    // Note a failed CAS on head. Returns whether to try the elimination
+    // array.
+    static bool casFailed(void) {
+        rcu::addStat(rcu::Stat::LIST_CAS_RETRIES);
+
+        auto &score = contention();
+        score = std::min(score + 2, LIST_CONTENTION_MAX);
+        return score >= LIST_ELIMINATION_THRESHOLD;
+    }
+
+    // Note that a push or pop that failed a CAS went through, one way or
+    // the other.
+    static void contendedDone(void) {
+        auto &score = contention();
+        score = score > 3 ? score - 3 : 0;
+    }
+
+    EliminationSlot &randomSlot(void) {
+        // xorshift64, seeded per thread.
+        thread_local std::uint64_t state =
+            0x9E3779B97F4A7C15ULL * (rcu::currentThreadIndex() + 1);
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return elimination[state % LIST_ELIMINATION_SLOTS];
+    }
+
+    // Offer node to a concurrent pop. Returns whether one took it, in which
+    // case node is no longer ours.
+    //
+    // Must be called in a read-side critical section, which keeps the pop
+    // from discarding node while we're still checking on it.
+    bool tryEliminatePush(RcuListNode *node) {
+        auto &slot = randomSlot().offer;
+
+        // Synchronizes-with the acquire CAS in tryEliminatePop, so that the
+        // pop sees node's data.
+        RcuListNode *expected = nullptr;
+        if (!slot.compare_exchange_strong(expected, node,
+                std::memory_order_release, std::memory_order_relaxed)) {
+            return false;
+        }
+
+        // No-one else can offer node, so the slot holding anything else
+        // means it was taken.
+        for (unsigned i = 0; i < LIST_ELIMINATION_SPINS; ++i) {
+            if (slot.load(std::memory_order_relaxed) != node) return true;
+            rcu::cpuRelax();
+        }
+
+        expected = node;
+        return !slot.compare_exchange_strong(expected, nullptr,
+                std::memory_order_relaxed);
+    }
+
+    // Take a node offered by a concurrent push, if there is one, which the
+    // caller then owns, and must discard like a popped one.
+    RcuListNode *tryEliminatePop(void) {
+        auto &slot = randomSlot().offer;
+
+        auto offer = slot.load(std::memory_order_relaxed);
+        if (offer == nullptr) return nullptr;
+        if (!slot.compare_exchange_strong(offer, nullptr,
+                std::memory_order_acquire, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        rcu::addStat(rcu::Stat::LIST_ELIMINATIONS);
+        return offer;
+    }
+
     std::atomic<RcuListNode *> head;
     char padding[rcu::CACHE_LINE_BYTES];
-    rcu::GarbageCollector<RcuListNode> gc;
+    EliminationSlot elimination[LIST_ELIMINATION_SLOTS];
+    rcu::NodePool<RcuListNode> pool;
+    rcu::GarbageCollector<RcuListNode, rcu::NodePool<RcuListNode>::Deleter,
+                          Flavor> gc;
 };
+
+using RcuList = BasicRcuList<>;
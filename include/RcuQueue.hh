@@ -0,0 +1,247 @@
+// A lock-free FIFO queue synchronized with userspace RCU.
+//
+// The Michael-Scott queue [1]: a linked list from head to tail that always
+// starts with a dummy node. enqueue links a node after the last one with a
+// CAS on its next pointer, and then swings tail to it; dequeue swings head
+// to the first real node, which becomes the new dummy, and takes its value.
+// Either may find tail lagging behind a node that's already linked, in which
+// case it helps swing it forward first.
+//
+// The original needs tagged pointers or hazard pointers to keep head and
+// tail CAS-es safe from ABA and dequeued nodes from being freed under other
+// threads. Here, as in RcuList::pop, every operation runs in a read-side
+// critical section, and dequeued nodes go to a GarbageCollector, so no node
+// anyone is still looking at can be freed and reused.
+//
+// Only the thread whose CAS on head takes a node ever touches its value, so
+// T needn't be anything more than move-constructible.
+//
+// [1] M. M. Michael and M. L. Scott, "Simple, Fast, and Practical
+//     Non-Blocking and Blocking Concurrent Queue Algorithms," PODC 1996.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+#include "NodePool.hh"
+#include "RCU.hh"
+
+template<typename T>
+struct RcuQueueNode {
+    std::atomic<RcuQueueNode *> next;
+    // Links dequeued nodes for the GC (see GarbageCollector::discard).
+    std::atomic<RcuQueueNode *> gcNext;
+    // Holds a T from when the node is enqueued until its value is dequeued;
+    // empty in the dummy.
+    alignas(T) unsigned char storage[sizeof(T)];
+
+    // Leaves storage alone, for whoever enqueues the node to fill in.
+    RcuQueueNode(RcuQueueNode *next, RcuQueueNode *gcNext)
+        : next(next), gcNext(gcNext) {}
+
+    T *value(void) {
+        return std::launder(reinterpret_cast<T *>(storage));
+    }
+
+    std::atomic<RcuQueueNode *> &getGcNext(void) {
+        return gcNext;
+    }
+};
+
+// Flavor is the RCU flavor its operations use (see RCU.hh).
+template<typename T, typename Flavor = rcu::MembarrierFlavor>
+class RcuQueue {
+public:
+    RcuQueue(rcu::GcPolicy policy = rcu::GcPolicy())
+        : pool(), gc(policy, { &pool }) {
+        Node *dummy = pool.create(nullptr, nullptr);
+        head.store(dummy, std::memory_order_relaxed);
+        tail.store(dummy, std::memory_order_relaxed);
+    }
+
+    RcuQueue(const RcuQueue &) = delete;
+    RcuQueue &operator=(const RcuQueue &) = delete;
+
+    // Destroy every value still in the queue.
+    //
+    // joinGC must already have been called.
+    ~RcuQueue() {
+        auto cur = head.load(std::memory_order_relaxed);
+        auto next = cur->next.load(std::memory_order_relaxed);
+        pool.destroy(cur);
+        while (next != nullptr) {
+            cur = next;
+            next = cur->next.load(std::memory_order_relaxed);
+            cur->value()->~T();
+            pool.destroy(cur);
+        }
+    }
+
+    void joinGC(void) {
+        gc.join();
+    }
+
+    void enqueue(T value) {
+        Node *node = pool.create(nullptr, nullptr);
+        new (node->storage) T(std::move(value));
+        append(node, node);
+    }
+
+    // Enqueue every value in [begin, end), in order.
+    //
+    // The values are linked into a chain first, which then goes on with a
+    // single CAS.
+    template<typename Iterator>
+    void enqueueBatch(Iterator begin, Iterator end) {
+        if (begin == end) return;
+
+        Node *first = pool.create(nullptr, nullptr);
+        new (first->storage) T(*begin);
+        Node *last = first;
+        for (++begin; begin != end; ++begin) {
+            Node *node = pool.create(nullptr, nullptr);
+            new (node->storage) T(*begin);
+            last->next.store(node, std::memory_order_relaxed);
+            last = node;
+        }
+
+        append(first, last);
+    }
+
+    // Move the value at the front of the queue into out.
+    //
+    // Returns false, leaving out alone, if the queue is empty.
+    bool dequeue(T &out) {
+        return dequeueBatch(1, &out) == 1;
+    }
+
+    // Move up to n values from the front of the queue into out, oldest
+    // first.
+    //
+    // Detaches them with a single CAS on head, and discards them all at
+    // once. Returns how many values were dequeued, which is less than n only
+    // if the queue ran out.
+    size_t dequeueBatch(size_t n, T *out) {
+        if (n == 0) return 0;
+
+        Node *oldHead;
+        Node *newHead;
+        Node *cur;
+        size_t count;
+
+        {
+            rcu::BasicReadGuard<Flavor> guard;
+
+            while (true) {
+                oldHead = head.load(std::memory_order_acquire);
+                Node *oldTail = tail.load(std::memory_order_acquire);
+                Node *first = oldHead->next.load(std::memory_order_acquire);
+                if (first == nullptr) return 0;
+
+                // head must never pass tail, or tail would be left on a
+                // discarded node.
+                if (oldHead == oldTail) {
+                    tail.compare_exchange_weak(oldTail, first,
+                            std::memory_order_release,
+                            std::memory_order_relaxed);
+                    continue;
+                }
+
+                // Take nodes up to n, or up to tail. Linked next pointers
+                // never change, so this is the chain the CAS takes.
+                newHead = first;
+                count = 1;
+                while (count < n && newHead != oldTail) {
+                    Node *next = newHead->next.load(
+                            std::memory_order_acquire);
+                    if (next == nullptr) break;
+                    newHead = next;
+                    count++;
+                }
+
+                // Not subject to ABA: RCU keeps oldHead from being reused
+                // while we're in our critical section, as in RcuList::pop.
+                if (head.compare_exchange_weak(oldHead, newHead,
+                        std::memory_order_acquire,
+                        std::memory_order_relaxed)) {
+                    break;
+                }
+                rcu::addStat(rcu::Stat::LIST_CAS_RETRIES);
+            }
+
+            // The values after oldHead up to and including newHead's, which
+            // is the new dummy, are ours, and no-one else touches them. We
+            // still need the critical section, though: newHead is back in
+            // the queue, and may be dequeued and freed as soon as we leave.
+            //
+            // The nodes before newHead, which readers may still follow, are
+            // linked for the GC through gcNext.
+            cur = oldHead;
+            for (size_t i = 0; i < count; ++i) {
+                Node *next = cur->next.load(std::memory_order_relaxed);
+                out[i] = std::move(*next->value());
+                next->value()->~T();
+                if (i + 1 < count) {
+                    cur->gcNext.store(next, std::memory_order_relaxed);
+                    cur = next;
+                }
+            }
+        }
+
+        gc.discardChain(oldHead, cur, count);
+        return count;
+    }
+
+    // Whether the queue was empty at some point during the call.
+    bool empty(void) const {
+        rcu::BasicReadGuard<Flavor> guard;
+        rcu::Protected<Node *, Flavor> front(head);
+        return front->next.load(std::memory_order_relaxed) == nullptr;
+    }
+
+private:
+    using Node = RcuQueueNode<T>;
+
+    // Link the chain from first to last after the last node, and swing tail
+    // to last.
+    void append(Node *first, Node *last) {
+        rcu::BasicReadGuard<Flavor> guard;
+
+        while (true) {
+            Node *oldTail = tail.load(std::memory_order_acquire);
+            Node *next = oldTail->next.load(std::memory_order_acquire);
+
+            if (next != nullptr) {
+                // tail is lagging; help it along.
+                tail.compare_exchange_weak(oldTail, next,
+                        std::memory_order_release,
+                        std::memory_order_relaxed);
+                continue;
+            }
+
+            // Synchronizes-with the acquire loads of next, so that dequeuers
+            // see the values fully constructed.
+            if (oldTail->next.compare_exchange_weak(next, first,
+                    std::memory_order_release,
+                    std::memory_order_relaxed)) {
+                // Fine if this fails: someone already helped tail along.
+                tail.compare_exchange_strong(oldTail, last,
+                        std::memory_order_release,
+                        std::memory_order_relaxed);
+                return;
+            }
+            rcu::addStat(rcu::Stat::LIST_CAS_RETRIES);
+        }
+    }
+
+    // Dequeuers and enqueuers each get a cache line of their own.
+    alignas(rcu::CACHE_LINE_BYTES) std::atomic<Node *> head;
+    alignas(rcu::CACHE_LINE_BYTES) std::atomic<Node *> tail;
+    alignas(rcu::CACHE_LINE_BYTES) rcu::NodePool<Node> pool;
+    rcu::GarbageCollector<Node, typename rcu::NodePool<Node>::Deleter,
+                          Flavor> gc;
+};
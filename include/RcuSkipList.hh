@@ -0,0 +1,425 @@
+// An ordered map synchronized with userspace RCU.
+//
+// A lock-free skip list in the style of Fraser and Herlihy et al.: a node is
+// erased by first marking each of its next pointers, top level first, and
+// then unlinking it from every level, a step which any thread that runs into
+// it helps with. Lookups and range scans never write anything, and run
+// entirely inside a read-side critical section. Since erased nodes are
+// only deleted a grace period after they've been unlinked, nothing needs
+// hazard pointers or reference counts, and none of the CAS-es are subject to
+// the ABA problem.
+//
+// Keys are unique; insert doesn't overwrite an existing key. K and V must be
+// default-constructible, for the head node.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <utility>
+
+#include "Poison.hh"
+#include "RCU.hh"
+
+//////////////////////////////////////////////////////////////////////////////
+// Constants.
+//
+
+// The tallest a tower can be. With one in SKIP_LIST_FANOUT nodes promoted to
+// each next level, this keeps lookups logarithmic up to around 4^16 nodes.
+const unsigned SKIP_LIST_MAX_HEIGHT = 16;
+
+// The inverse of the chance that a node is promoted to the next level.
+const unsigned SKIP_LIST_FANOUT = 4;
+
+//////////////////////////////////////////////////////////////////////////////
+// RcuSkipList.
+//
+
+template<typename K, typename V>
+struct RcuSkipListNode {
+    // For the GC, which must leave next alone: readers may still be
+    // descending through a discarded node (see GarbageCollector::discard).
+    std::atomic<RcuSkipListNode *> gcNext;
+    K key;
+    V value;
+    unsigned height;
+    // Which halves of the insert/erase handshake are done; see
+    // RcuSkipList::linkingDone.
+    std::atomic<std::uint32_t> handshake;
+    // One tagged pointer per level, of which there are height. The low bit
+    // is set once this node has been erased from that level.
+    std::atomic<std::uintptr_t> next[1];
+
+    std::atomic<RcuSkipListNode *> &getGcNext(void) {
+        return gcNext;
+    }
+};
+
+template<typename K, typename V, typename Compare = std::less<K>,
+         typename Flavor = rcu::MembarrierFlavor>
+class RcuSkipList {
+public:
+    RcuSkipList(rcu::GcPolicy policy = rcu::GcPolicy())
+        : head(createNode(SKIP_LIST_MAX_HEIGHT, K(), V())), gc(policy) {}
+
+    RcuSkipList(const RcuSkipList &) = delete;
+    RcuSkipList &operator=(const RcuSkipList &) = delete;
+
+    // Delete every node still in the list.
+    //
+    // joinGC must already have been called.
+    ~RcuSkipList() {
+        Node *cur = head;
+        while (cur != nullptr) {
+            Node *next = unmark(cur->next[0].load(std::memory_order_relaxed));
+            destroyNode(cur);
+            cur = next;
+        }
+    }
+
+    void joinGC(void) {
+        gc.join();
+    }
+
+    // Add key, unless it's already there.
+    //
+    // Returns whether key was added. Lock-free.
+    bool insert(const K &key, const V &value) {
+        rcu::BasicReadGuard<Flavor> guard;
+
+        Node *preds[SKIP_LIST_MAX_HEIGHT];
+        Node *succs[SKIP_LIST_MAX_HEIGHT];
+        unsigned height = randomHeight();
+        Node *node = nullptr;
+
+        while (true) {
+            if (findPosition(key, preds, succs)) {
+                if (node != nullptr) destroyNode(node);
+                return false;
+            }
+
+            if (node == nullptr) {
+                node = createNode(height, key, value);
+            }
+            for (unsigned level = 0; level < height; ++level) {
+                node->next[level].store(tag(succs[level]),
+                                        std::memory_order_relaxed);
+            }
+
+            // Synchronizes-with the acquire loads in readers, so they see
+            // node fully constructed.
+            auto expected = tag(succs[0]);
+            if (preds[0]->next[0].compare_exchange_strong(expected, tag(node),
+                    std::memory_order_release, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+
+        // node is now in the list; link it into the levels above. If it's
+        // erased in the meantime, give up: the erasing thread unlinks it
+        // from whichever levels it made it into.
+        for (unsigned level = 1; level < height; ++level) {
+            while (true) {
+                auto expected = tag(succs[level]);
+                if (preds[level]->next[level].compare_exchange_strong(
+                        expected, tag(node), std::memory_order_release,
+                        std::memory_order_relaxed)) {
+                    break;
+                }
+
+                // Our view of this level is out of date. Refresh it, and
+                // point node's own next pointer at the new successor,
+                // unless node has been erased.
+                findPosition(key, preds, succs);
+                auto oldNext = node->next[level].load(
+                        std::memory_order_relaxed);
+                if (isMarked(oldNext)
+                 || !node->next[level].compare_exchange_strong(oldNext,
+                        tag(succs[level]), std::memory_order_relaxed)) {
+                    linkingDone(node);
+                    return true;
+                }
+                // node itself may since have been unlinked at level 0.
+                if (succs[0] != node) {
+                    linkingDone(node);
+                    return true;
+                }
+            }
+        }
+
+        linkingDone(node);
+        return true;
+    }
+
+    // Remove key, if it's there.
+    //
+    // Returns whether key was removed. Lock-free.
+    bool erase(const K &key) {
+        rcu::BasicReadGuard<Flavor> guard;
+
+        Node *preds[SKIP_LIST_MAX_HEIGHT];
+        Node *succs[SKIP_LIST_MAX_HEIGHT];
+        if (!findPosition(key, preds, succs)) {
+            return false;
+        }
+        Node *node = succs[0];
+
+        // Mark the upper levels first, which keeps insert from linking node
+        // into any more of them.
+        for (unsigned level = node->height - 1; level > 0; --level) {
+            node->next[level].fetch_or(1, std::memory_order_relaxed);
+        }
+
+        // Marking level 0 is what erases the key. If someone else got there
+        // first, they erased it.
+        auto oldNext = node->next[0].fetch_or(1, std::memory_order_relaxed);
+        if (isMarked(oldNext)) {
+            return false;
+        }
+
+        unlinkingDone(node);
+        return true;
+    }
+
+    bool contains(const K &key) const {
+        rcu::BasicReadGuard<Flavor> guard;
+        Node *node = lowerBound(key);
+        return node != nullptr && !less(key, node->key);
+    }
+
+    // Copy key's value into value, if key is there.
+    //
+    // Returns whether it was there.
+    bool find(const K &key, V &value) const {
+        rcu::BasicReadGuard<Flavor> guard;
+        Node *node = lowerBound(key);
+        if (node == nullptr || less(key, node->key)) {
+            return false;
+        }
+
+        value = node->value;
+        return true;
+    }
+
+    // Call fn(key, value) for every key in [lo, hi), in order.
+    //
+    // Runs inside a single read-side critical section, so fn sees the list
+    // as it was at some point during the scan, plus or minus keys being
+    // concurrently inserted and erased. fn must not block for long, or call
+    // synchronize.
+    template<typename Fn>
+    void forEachInRange(const K &lo, const K &hi, Fn &&fn) const {
+        rcu::BasicReadGuard<Flavor> guard;
+
+        Node *cur = lowerBound(lo);
+        while (cur != nullptr && less(cur->key, hi)) {
+            auto next = cur->next[0].load(std::memory_order_acquire);
+            if (!isMarked(next)) {
+                fn(static_cast<const K &>(cur->key),
+                   static_cast<const V &>(cur->value));
+            }
+            cur = unmark(next);
+        }
+    }
+
+private:
+    using Node = RcuSkipListNode<K, V>;
+
+    // Nodes are deleted by RcuSkipList rather than by the GC's usual
+    // delete, since they're variable-size.
+    struct Deleter {
+        void operator()(Node *node) const {
+            destroyNode(node);
+        }
+    };
+
+    // The halves of a node's insert/erase handshake. See linkingDone.
+    static const std::uint32_t LINKED = 1;
+    static const std::uint32_t UNLINKED = 2;
+
+    //////////////////////////////////////////////////////////////////////////
+    // Nodes.
+    //
+
+    // Allocate a node with the given height.
+    //
+    // Nodes are aligned to, and padded to a multiple of, a cache line, so a
+    // node's key and lowest levels always share one line. Towers are short
+    // (three quarters of nodes have just one level), so most nodes fit in a
+    // single line.
+    static Node *createNode(unsigned height, const K &key, const V &value) {
+        auto mem = ::operator new(nodeBytes(height),
+                std::align_val_t(rcu::CACHE_LINE_BYTES));
+        auto node = new (mem) Node { { nullptr }, key, value, height, { 0 },
+                                     { { 0 } } };
+        for (unsigned level = 1; level < height; ++level) {
+            new (&node->next[level]) std::atomic<std::uintptr_t>(0);
+        }
+
+        return node;
+    }
+
+    static void destroyNode(Node *node) {
+        auto bytes = nodeBytes(node->height);
+        node->~Node();
+        rcu::poison(node, bytes);
+        ::operator delete(node, std::align_val_t(rcu::CACHE_LINE_BYTES));
+    }
+
+    // The bytes a node of height levels takes, padded to a cache line.
+    static size_t nodeBytes(unsigned height) {
+        auto bytes = sizeof(Node)
+                   + (height - 1) * sizeof(std::atomic<std::uintptr_t>);
+        return (bytes + rcu::CACHE_LINE_BYTES - 1)
+             & ~(rcu::CACHE_LINE_BYTES - 1);
+    }
+
+    static std::uintptr_t tag(Node *node) {
+        return reinterpret_cast<std::uintptr_t>(node);
+    }
+
+    static Node *unmark(std::uintptr_t next) {
+        return reinterpret_cast<Node *>(next & ~std::uintptr_t(1));
+    }
+
+    static bool isMarked(std::uintptr_t next) {
+        return (next & 1) != 0;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Searching.
+    //
+
+    bool less(const K &a, const K &b) const {
+        return compare(a, b);
+    }
+
+    // Find key's neighbours at every level, unlinking any erased nodes along
+    // the way.
+    //
+    // Sets preds[level] to the last node before key and succs[level] to the
+    // first at or after it. Returns whether succs[0] holds key.
+    //
+    // Must be called in a read-side critical section.
+    bool findPosition(const K &key, Node **preds, Node **succs) {
+    retry:
+        Node *pred = head;
+        for (int level = SKIP_LIST_MAX_HEIGHT - 1; level >= 0; --level) {
+            Node *cur = unmark(pred->next[level].load(
+                    std::memory_order_acquire));
+
+            while (cur != nullptr) {
+                auto next = cur->next[level].load(std::memory_order_acquire);
+
+                if (isMarked(next)) {
+                    // Unlink cur from this level. If pred has changed, or
+                    // has itself been erased, start over.
+                    auto expected = tag(cur);
+                    if (!pred->next[level].compare_exchange_strong(expected,
+                            tag(unmark(next)), std::memory_order_release,
+                            std::memory_order_relaxed)) {
+                        goto retry;
+                    }
+                    cur = unmark(next);
+                    continue;
+                }
+
+                if (!less(cur->key, key)) break;
+                pred = cur;
+                cur = unmark(next);
+            }
+
+            preds[level] = pred;
+            succs[level] = cur;
+        }
+
+        return succs[0] != nullptr && !less(key, succs[0]->key);
+    }
+
+    // Find the first non-erased node at or after key, without helping
+    // anyone.
+    //
+    // Must be called in a read-side critical section.
+    Node *lowerBound(const K &key) const {
+        Node *pred = head;
+        Node *cur = nullptr;
+
+        for (int level = SKIP_LIST_MAX_HEIGHT - 1; level >= 0; --level) {
+            cur = unmark(pred->next[level].load(std::memory_order_acquire));
+            while (cur != nullptr) {
+                auto next = cur->next[level].load(std::memory_order_acquire);
+                if (!isMarked(next) && !less(cur->key, key)) break;
+                if (!isMarked(next)) pred = cur;
+                cur = unmark(next);
+            }
+        }
+
+        return cur;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Reclamation.
+    //
+    // A node can't be discarded until it's unlinked from every level, and
+    // insert may still be linking it into upper levels after erase has
+    // marked it. So whichever of the inserting and erasing threads finishes
+    // second sweeps the node out of every level and discards it.
+    //
+
+    void linkingDone(Node *node) {
+        if (handshake(node, LINKED) & UNLINKED) {
+            sweep(node);
+        }
+    }
+
+    void unlinkingDone(Node *node) {
+        if (handshake(node, UNLINKED) & LINKED) {
+            sweep(node);
+        }
+    }
+
+    // Record that one half of the handshake is done, and return what was
+    // done before.
+    //
+    // acq_rel so that whoever sweeps sees every link the other thread made.
+    static std::uint32_t handshake(Node *node, std::uint32_t bit) {
+        return node->handshake.fetch_or(bit, std::memory_order_acq_rel);
+    }
+
+    void sweep(Node *node) {
+        Node *preds[SKIP_LIST_MAX_HEIGHT];
+        Node *succs[SKIP_LIST_MAX_HEIGHT];
+
+        // node is marked at every level, and precedes any live node with the
+        // same key, so searching for its key unlinks it everywhere.
+        findPosition(node->key, preds, succs);
+        gc.discard(node);
+    }
+
+    unsigned randomHeight(void) {
+        // xorshift64, seeded per thread.
+        thread_local std::uint64_t state =
+            0x9E3779B97F4A7C15ULL * (rcu::currentThreadIndex() + 1);
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        unsigned height = 1;
+        auto bits = state;
+        while (height < SKIP_LIST_MAX_HEIGHT && bits % SKIP_LIST_FANOUT == 0) {
+            height++;
+            bits /= SKIP_LIST_FANOUT;
+        }
+        return height;
+    }
+
+    Node *head;
+    Compare compare;
+    rcu::GarbageCollector<Node, Deleter, Flavor> gc;
+};
@@ -0,0 +1,181 @@
+// An unrolled variant of RcuList, with many values per node.
+//
+// RcuList takes a cache miss for every few values search looks at. Here, each
+// node holds as many values as fit in NodeBytes, so search scans whole nodes
+// of contiguous values with SIMD (see SimdSearch.hh), and only chases a
+// pointer per node.
+//
+// Bigger nodes make push and pop copy more. The default of four cache lines
+// searches a 100k-element list about twice as fast as RcuList; a single line
+// is no faster than RcuList, whose nodes NodePool lays out sequentially.
+//
+// Nodes are never modified once published. push and pop build a modified copy
+// of the head node and swap it in with a CAS, and the replaced node goes to
+// the GarbageCollector.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+#include "NodePool.hh"
+#include "RCU.hh"
+#include "SimdSearch.hh"
+
+template<size_t NodeBytes>
+struct alignas(rcu::CACHE_LINE_BYTES) RcuUnrolledListNode {
+    // How many values fit alongside the header.
+    static constexpr size_t CAPACITY =
+        (NodeBytes - 2 * sizeof(void *) - sizeof(std::uint64_t))
+        / sizeof(std::uint64_t);
+
+    static_assert(CAPACITY >= 1, "RcuUnrolledList nodes must hold a value");
+
+    std::atomic<RcuUnrolledListNode *> next;
+    // The GC's, once the node is discarded (see GarbageCollector::discard).
+    std::atomic<RcuUnrolledListNode *> gcNext;
+    std::uint64_t count;
+    // The bottom of the stack first.
+    std::uint64_t data[CAPACITY];
+
+    std::atomic<RcuUnrolledListNode *> &getGcNext(void) {
+        return gcNext;
+    }
+};
+
+template<size_t NodeBytes = 4 * rcu::CACHE_LINE_BYTES,
+         typename Flavor = rcu::MembarrierFlavor>
+class RcuUnrolledList {
+public:
+    RcuUnrolledList(rcu::GcPolicy policy = rcu::GcPolicy())
+        : head(nullptr), pool(), gc(policy, { &pool }) {}
+
+    void joinGC(void) {
+        gc.join();
+    }
+
+    uint64_t pop() {
+        // Only needed if the head node has more than one value.
+        Node *replacement = nullptr;
+
+        while (true) {
+            // Use RCU for ABA protection, as in RcuList::pop.
+            rcu::BasicReadGuard<Flavor> guard;
+            rcu::Protected<Node *, Flavor> protectedHead(head);
+            Node *oldHead = protectedHead.get();
+            if (oldHead == nullptr) break;
+
+            auto count = oldHead->count;
+            Node *newHead;
+            if (count == 1) {
+                newHead = oldHead->next.load(std::memory_order_relaxed);
+            } else {
+                if (replacement == nullptr) replacement = pool.create();
+                copyNode(replacement, oldHead, count - 1);
+                newHead = replacement;
+            }
+
+            if (head.compare_exchange_weak(oldHead, newHead,
+                    std::memory_order_release)) {
+                if (replacement != nullptr && newHead != replacement) {
+                    pool.destroy(replacement);
+                }
+
+                uint64_t result = oldHead->data[count - 1];
+                gc.discard(oldHead);
+                return result;
+            }
+        }
+
+        if (replacement != nullptr) pool.destroy(replacement);
+        return 0xDEAD;
+    }
+
+    void push(std::uint64_t data) {
+        auto newNode = pool.create();
+
+        while (true) {
+            // See the comments in pop for an explanation of how this is
+            // synchronized.
+            rcu::BasicReadGuard<Flavor> guard;
+            rcu::Protected<Node *, Flavor> oldHead(head);
+
+            // Fill the head node before starting a new one.
+            bool copied = oldHead && oldHead->count < Node::CAPACITY;
+            if (copied) {
+                copyNode(newNode, oldHead.get(), oldHead->count);
+            } else {
+                newNode->next.store(oldHead.get(), std::memory_order_relaxed);
+                newNode->count = 0;
+            }
+            newNode->data[newNode->count++] = data;
+
+            auto expected = oldHead.get();
+            if (head.compare_exchange_weak(expected, newNode,
+                    std::memory_order_release)) {
+                if (copied) {
+                    gc.discard(oldHead.get());
+                }
+                return;
+            }
+        }
+    }
+
+    bool search(std::uint64_t data) {
+        rcu::BasicReadGuard<Flavor> guard;
+
+        for (rcu::Protected<Node *, Flavor> cur(head);
+             cur;
+             cur = rcu::Protected<Node *, Flavor>(cur->next)) {
+            if (rcu::containsValue(cur->data, cur->count, data)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Set found[i] to search(values[i]) for every i below n.
+    //
+    // Makes a single pass over the list, in a single read-side critical
+    // section, stopping once everything has been found.
+    void searchMany(const std::uint64_t *values, size_t n, bool *found) {
+        std::fill(found, found + n, false);
+        size_t remaining = n;
+
+        rcu::BasicReadGuard<Flavor> guard;
+
+        for (rcu::Protected<Node *, Flavor> cur(head);
+             cur && remaining > 0;
+             cur = rcu::Protected<Node *, Flavor>(cur->next)) {
+            for (size_t i = 0; i < n; ++i) {
+                if (!found[i]
+                 && rcu::containsValue(cur->data, cur->count, values[i])) {
+                    found[i] = true;
+                    remaining--;
+                }
+            }
+        }
+    }
+
+private:
+    using Node = RcuUnrolledListNode<NodeBytes>;
+
+    // Make the unpublished node to a copy of from, with just its first count
+    // values.
+    static void copyNode(Node *to, const Node *from, std::uint64_t count) {
+        to->next.store(from->next.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+        to->count = count;
+        std::memcpy(to->data, from->data, count * sizeof(std::uint64_t));
+    }
+
+    std::atomic<Node *> head;
+    char padding[rcu::CACHE_LINE_BYTES];
+    rcu::NodePool<Node> pool;
+    rcu::GarbageCollector<Node, typename rcu::NodePool<Node>::Deleter,
+                          Flavor> gc;
+};
@@ -0,0 +1,22 @@
+// Vectorized searches over arrays of values.
+//
+// Each search comes in AVX-512, AVX2 and plain versions, and the best one the
+// CPU supports is picked the first time it's called. None of this needs any
+// special compiler flags.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace rcu {
+
+// Whether any of the n values starting at data is value.
+bool containsValue(const std::uint64_t *data, size_t n, std::uint64_t value);
+
+// The name of the version containsValue uses on this CPU: "avx512", "avx2" or
+// "scalar".
+const char *searchKernelName(void);
+
+}
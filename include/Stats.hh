@@ -0,0 +1,300 @@
+// Runtime statistics: counters and latency histograms for grace periods,
+// reclamation, and the lock-free structures' retry loops.
+//
+// Only collected if RCU_STATS is defined (or configured with -DRCU_STATS=ON),
+// which, like RCU_INITIAL_EXEC_TLS, must be done the same way in every
+// translation unit. Otherwise every hook below is an empty inline function
+// and statsClock never reads the clock, so they cost nothing, and snapshots
+// are all zeros.
+//
+// Each thread counts into a block of its own, with plain relaxed stores, and
+// statsSnapshot adds up every thread's block (plus whatever threads that
+// have exited left behind) on demand. Threads needn't be registered with
+// RCU to count.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace rcu {
+
+//////////////////////////////////////////////////////////////////////////////
+// Constants.
+//
+
+#ifdef RCU_STATS
+constexpr bool STATS_ENABLED = true;
+#else
+constexpr bool STATS_ENABLED = false;
+#endif
+
+// Latency histograms split each power of two into 2^HISTOGRAM_SUB_BITS
+// buckets, so they're accurate to within about 6%.
+const unsigned HISTOGRAM_SUB_BITS = 4;
+
+const size_t HISTOGRAM_BUCKETS = (65 - HISTOGRAM_SUB_BITS)
+                               << HISTOGRAM_SUB_BITS;
+
+//////////////////////////////////////////////////////////////////////////////
+// What we count.
+//
+
+enum class Stat {
+    // Grace periods synchronize and synchronizeExpedited ran, and calls that
+    // returned on the back of someone else's instead.
+    GRACE_PERIODS,
+    SHARED_GRACE_PERIODS,
+    // Grace periods QsbrFlavor::synchronize started.
+    QSBR_GRACE_PERIODS,
+    // Times a grace period of either flavor found a reader it had to wait
+    // for, and how it waited: CPU pauses, yields, and sleeps (futex waits or
+    // polls).
+    READER_WAITS,
+    READER_SPINS,
+    READER_YIELDS,
+    READER_SLEEPS,
+    // Objects GarbageCollectors have been handed by discard, objects they
+    // have reclaimed, and how many passes that took. The first two's
+    // difference is the backlog.
+    GC_PUBLISHED,
+    GC_RECLAIMED,
+    GC_RECLAIM_PASSES,
+    // Failed CAS-es on RcuList heads and RcuQueue ends, batched or not, and
+    // push-pop pairs RcuList's elimination arrays cancelled out.
+    LIST_CAS_RETRIES,
+    LIST_ELIMINATIONS,
+};
+
+const size_t STAT_COUNT = static_cast<size_t>(Stat::LIST_ELIMINATIONS) + 1;
+
+// Latencies, in nanoseconds.
+enum class Latency {
+    // synchronize and synchronizeExpedited calls, shared or not.
+    GRACE_PERIOD,
+    // QsbrFlavor::synchronize calls.
+    QSBR_GRACE_PERIOD,
+    // From when the oldest object in a GarbageCollector's batch was handed
+    // to its GC thread until the batch was reclaimed.
+    RECLAIM_DELAY,
+};
+
+const size_t LATENCY_COUNT = static_cast<size_t>(Latency::RECLAIM_DELAY) + 1;
+
+// Stable names for exporting to metrics systems, e.g. "grace_periods".
+const char *statName(Stat stat);
+const char *latencyName(Latency latency);
+
+//////////////////////////////////////////////////////////////////////////////
+// Snapshots.
+//
+
+// A log-linear histogram of latencies, in the style of HdrHistogram: values
+// below 2^HISTOGRAM_SUB_BITS get a bucket each, and larger ones share
+// buckets 1/2^HISTOGRAM_SUB_BITS of their power of two wide.
+class LatencyHistogram {
+public:
+    static size_t bucketFor(std::uint64_t value) {
+        if (value < (1ULL << HISTOGRAM_SUB_BITS)) return value;
+
+        unsigned exponent = 63 - __builtin_clzll(value);
+        auto shift = exponent - HISTOGRAM_SUB_BITS;
+        auto sub = (value >> shift) & ((1ULL << HISTOGRAM_SUB_BITS) - 1);
+        return ((shift + 1) << HISTOGRAM_SUB_BITS) + sub;
+    }
+
+    // The lowest and highest values that go in bucket.
+    static std::uint64_t bucketLowest(size_t bucket) {
+        if (bucket < (1ULL << HISTOGRAM_SUB_BITS)) return bucket;
+
+        auto shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+        auto sub = bucket & ((1ULL << HISTOGRAM_SUB_BITS) - 1);
+        return ((1ULL << HISTOGRAM_SUB_BITS) + sub) << shift;
+    }
+
+    static std::uint64_t bucketHighest(size_t bucket) {
+        if (bucket < (1ULL << HISTOGRAM_SUB_BITS)) return bucket;
+
+        auto shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+        return bucketLowest(bucket) + ((1ULL << shift) - 1);
+    }
+
+    void record(std::uint64_t value, std::uint64_t times = 1) {
+        buckets[bucketFor(value)] += times;
+        total += times;
+        sum += value * times;
+        if (value > highest) highest = value;
+    }
+
+    // Add n values that went in bucket, without touching the sum or the
+    // maximum, which addTotals then adds. For rebuilding histograms kept
+    // elsewhere.
+    void addBucket(size_t bucket, std::uint64_t n) {
+        buckets[bucket] += n;
+        total += n;
+    }
+
+    void addTotals(std::uint64_t valueSum, std::uint64_t max) {
+        sum += valueSum;
+        if (max > highest) highest = max;
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            buckets[i] += other.buckets[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        if (other.highest > highest) highest = other.highest;
+    }
+
+    std::uint64_t count(void) const {
+        return total;
+    }
+
+    std::uint64_t max(void) const {
+        return highest;
+    }
+
+    double mean(void) const {
+        return total == 0 ? 0 : static_cast<double>(sum) / total;
+    }
+
+    // The highest value in the bucket holding the pth quantile (0 to 1), or
+    // 0 if nothing has been recorded.
+    std::uint64_t percentile(double p) const {
+        if (total == 0) return 0;
+
+        auto rank = static_cast<std::uint64_t>(p * total);
+        if (rank >= total) rank = total - 1;
+
+        std::uint64_t seen = 0;
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            seen += buckets[i];
+            if (seen > rank) {
+                return std::min(bucketHighest(i), highest);
+            }
+        }
+        return highest;
+    }
+
+    // How many values went in bucket.
+    std::uint64_t bucketCount(size_t bucket) const {
+        return buckets[bucket];
+    }
+
+private:
+    std::uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+    std::uint64_t total = 0;
+    std::uint64_t sum = 0;
+    std::uint64_t highest = 0;
+};
+
+// Every thread's statistics, added up.
+struct StatsSnapshot {
+    std::uint64_t counters[STAT_COUNT] = {};
+    LatencyHistogram latencies[LATENCY_COUNT];
+
+    std::uint64_t get(Stat stat) const {
+        return counters[static_cast<size_t>(stat)];
+    }
+
+    const LatencyHistogram &get(Latency latency) const {
+        return latencies[static_cast<size_t>(latency)];
+    }
+};
+
+// Add up every thread's statistics so far.
+//
+// Takes a lock, and reads a few kilobytes per thread that has ever counted
+// anything, so it's meant for occasional monitoring rather than hot paths.
+// Threads still counting may be caught halfway through recording a latency.
+StatsSnapshot statsSnapshot(void);
+
+//////////////////////////////////////////////////////////////////////////////
+// Recording.
+//
+
+inline void addStat(Stat stat, std::uint64_t n = 1);
+
+// Record a latency of ns nanoseconds, measured with statsClock.
+inline void recordLatency(Latency latency, std::uint64_t ns);
+
+// A timestamp in nanoseconds for recordLatency, or 0 if stats are off.
+inline std::uint64_t statsClock(void);
+
+//////////////////////////////////////////////////////////////////////////////
+// Inline function definitions.
+//
+
+#ifdef RCU_STATS
+
+// A thread's statistics. Only that thread writes to it.
+struct ThreadStats {
+    struct Histogram {
+        std::atomic<std::uint64_t> buckets[HISTOGRAM_BUCKETS];
+        std::atomic<std::uint64_t> sum;
+        std::atomic<std::uint64_t> highest;
+    };
+
+    std::atomic<std::uint64_t> counters[STAT_COUNT];
+    Histogram latencies[LATENCY_COUNT];
+};
+
+inline thread_local ThreadStats *threadStats = nullptr;
+
+// Allocate the current thread's block, to be handed back when it exits.
+ThreadStats *createThreadStats(void);
+
+// Add n to a counter that only this thread writes. Cheaper than a
+// read-modify-write, and still safe to read elsewhere.
+inline void bumpStat(std::atomic<std::uint64_t> &counter, std::uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+inline ThreadStats &currentThreadStats(void) {
+    auto stats = threadStats;
+    if (__builtin_expect(stats == nullptr, 0)) {
+        stats = createThreadStats();
+    }
+    return *stats;
+}
+
+inline void addStat(Stat stat, std::uint64_t n) {
+    bumpStat(currentThreadStats().counters[static_cast<size_t>(stat)], n);
+}
+
+inline void recordLatency(Latency latency, std::uint64_t ns) {
+    auto &histogram =
+        currentThreadStats().latencies[static_cast<size_t>(latency)];
+
+    bumpStat(histogram.buckets[LatencyHistogram::bucketFor(ns)], 1);
+    bumpStat(histogram.sum, ns);
+    if (ns > histogram.highest.load(std::memory_order_relaxed)) {
+        histogram.highest.store(ns, std::memory_order_relaxed);
+    }
+}
+
+inline std::uint64_t statsClock(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#else
+
+inline void addStat(Stat, std::uint64_t) {}
+
+inline void recordLatency(Latency, std::uint64_t) {}
+
+inline std::uint64_t statsClock(void) {
+    return 0;
+}
+
+#endif
+
+}
@@ -1,11 +1,14 @@
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <new>
 #include <string>
 #include <vector>
 
 #include "HAMT.hh"
+#include "Poison.hh"
 
 // We do some sketchy memory stuff that GCC doesn't like. Disable that
 // warning.
@@ -40,7 +43,7 @@
 // Since we use up 4 bytes per iteration of this procedure, we'll separate
 // the key from any different in time and space linear in the size of the
 // key. 
-uint64_t getNthBackup(const std::string &str, unsigned n)  {
+uint64_t getNthBackup(std::string_view str, unsigned n)  {
     std::uint64_t result = 0;
     uint8_t *bytes = (uint8_t *)&result;
 
@@ -60,7 +63,8 @@ uint64_t getNthBackup(const std::string &str, unsigned n)  {
 // TopLevelHamtNode method definitions.
 //
 
-void TopLevelHamtNode::insert(uint64_t hash, std::string &&str) {
+void TopLevelHamtNode::insert(HamtNodeArena &arena, uint64_t hash,
+                              std::string &&str) {
     HamtNodeEntry *entryToInsert = &table[hash & FIRST_N_BITS];
     unsigned level = 0;
 
@@ -108,7 +112,7 @@ void TopLevelHamtNode::insert(uint64_t hash, std::string &&str) {
                 auto leaf = std::make_unique<HamtLeaf>(std::move(str), hash);
 
                 std::unique_ptr<HamtNode> newNode(
-                        new (nChildren) HamtNode(std::move(nodeToInsertAt),
+                        new (arena, nChildren) HamtNode(std::move(nodeToInsertAt),
                                                  HamtNodeEntry(std::move(leaf)),
                                                  hash));
 
@@ -119,14 +123,14 @@ void TopLevelHamtNode::insert(uint64_t hash, std::string &&str) {
             auto otherLeaf = entryToInsert->takeLeaf();
             auto otherHash = otherLeaf->hash;
 
-            if (lastHash == otherHash && str == otherLeaf->data) {
+            if (otherLeaf->matches(lastHash, str)) {
                 *entryToInsert = HamtNodeEntry(std::move(otherLeaf));
                 return;
             }
 
             if (UNLIKELY(level >= LEVELS_PER_HASH)
              && (level % LEVELS_PER_HASH) == 0) {
-                otherHash = getNthBackup(otherLeaf->data,
+                otherHash = getNthBackup(otherLeaf->data(),
                                          level / LEVELS_PER_HASH - 1);
             } else {
                 otherHash >>= BITS_PER_LEVEL;
@@ -134,8 +138,8 @@ void TopLevelHamtNode::insert(uint64_t hash, std::string &&str) {
             otherLeaf->hash = otherHash;
 
             std::unique_ptr<HamtNode> newNode(
-                    new (1) HamtNode(otherHash,
-                                     HamtNodeEntry(std::move(otherLeaf))));
+                    new (arena, 1) HamtNode(
+                            otherHash, HamtNodeEntry(std::move(otherLeaf))));
 
             *entryToInsert = HamtNodeEntry(std::move(newNode));
             hash = lastHash;
@@ -155,8 +159,7 @@ bool TopLevelHamtNode::find(uint64_t hash, const std::string &str) const {
 
     while (true) {
         if (entry->isLeaf()) {
-            auto leaf = entry->getLeaf();
-            return leaf.hash == lastHash && leaf.data == str;
+            return entry->getLeaf().matches(lastHash, str);
         } else {
             const HamtNode &node = entry->getChild();
 
@@ -180,7 +183,92 @@ bool TopLevelHamtNode::find(uint64_t hash, const std::string &str) const {
     }
 }
 
-void deleteFromNode(HamtNodeEntry *entry, uint64_t hash) {
+// A lookup in progress in findBatch.
+struct BatchLookup {
+    // The entry the key belongs in, at level.
+    const HamtNodeEntry *entry;
+    const std::string *key;
+    bool *found;
+    // The key's hash as of level, and as of the level below.
+    uint64_t lastHash;
+    uint64_t hash;
+    unsigned level;
+    // Whether entry itself is what we prefetched, rather than its target.
+    bool atEntry;
+};
+
+// Take one step of a lookup, touching only what the last step prefetched.
+//
+// Returns whether the lookup is finished.
+static bool stepLookup(BatchLookup &lookup) {
+    if (lookup.atEntry) {
+        if (lookup.entry->isNull()) {
+            *lookup.found = false;
+            return true;
+        }
+
+        lookup.entry->prefetchTarget();
+        lookup.atEntry = false;
+        return false;
+    }
+
+    if (lookup.entry->isLeaf()) {
+        *lookup.found = lookup.entry->getLeaf().matches(lookup.lastHash,
+                                                        *lookup.key);
+        return true;
+    }
+
+    const HamtNode &node = lookup.entry->getChild();
+    if (!node.containsHash(lookup.hash)) {
+        *lookup.found = false;
+        return true;
+    }
+
+    lookup.entry = &node.children[node.numberOfHashesAbove(lookup.hash) - 1];
+    __builtin_prefetch(lookup.entry);
+    lookup.atEntry = true;
+
+    lookup.lastHash = lookup.hash;
+    lookup.level++;
+    if (UNLIKELY(lookup.level >= LEVELS_PER_HASH)
+     && (lookup.level % LEVELS_PER_HASH) == 0) {
+        lookup.hash = getNthBackup(*lookup.key,
+                                   lookup.level / LEVELS_PER_HASH - 1);
+    } else {
+        lookup.hash >>= BITS_PER_LEVEL;
+    }
+    return false;
+}
+
+void TopLevelHamtNode::findBatch(const uint64_t *hashes,
+                                 const std::string *keys,
+                                 size_t nKeys, bool *found) const {
+    assert(nKeys <= HAMT_BATCH_GROUP);
+    BatchLookup lookups[HAMT_BATCH_GROUP];
+
+    for (size_t i = 0; i < nKeys; ++i) {
+        auto entry = &table[hashes[i] & FIRST_N_BITS];
+        __builtin_prefetch(entry);
+        lookups[i] = BatchLookup { entry, &keys[i], &found[i],
+                                   hashes[i], hashes[i] >> BITS_PER_LEVEL,
+                                   1, true };
+    }
+
+    // Round-robin over the unfinished lookups, which are kept at the front.
+    size_t remaining = nKeys;
+    while (remaining > 0) {
+        for (size_t i = 0; i < remaining;) {
+            if (stepLookup(lookups[i])) {
+                lookups[i] = lookups[--remaining];
+            } else {
+                ++i;
+            }
+        }
+    }
+}
+
+void deleteFromNode(HamtNodeArena &arena, HamtNodeEntry *entry,
+                    uint64_t hash) {
     assert(entry != NULL);
     assert(!entry->isNull());
 
@@ -200,13 +288,14 @@ void deleteFromNode(HamtNodeEntry *entry, uint64_t hash) {
 
         // Otherwise, we'll want to allocate a new, smaller node.
         std::unique_ptr<HamtNode> newNode(
-                new (nChildren - 1) HamtNode(std::move(node), hash));
+                new (arena, nChildren - 1) HamtNode(std::move(node), hash));
 
         *entry = HamtNodeEntry(std::move(newNode));
     }
 }
 
-bool TopLevelHamtNode::erase(uint64_t hash, const std::string &str) {
+bool TopLevelHamtNode::erase(HamtNodeArena &arena, uint64_t hash,
+                             const std::string &str) {
     HamtNodeEntry *entry = &table[hash & FIRST_N_BITS];
     HamtNodeEntry *entryToDeleteTo = entry;
     uint64_t hashToDeleteTo = hash >> 6;
@@ -228,8 +317,8 @@ bool TopLevelHamtNode::erase(uint64_t hash, const std::string &str) {
         if (entry->isLeaf()) {
             auto &leaf = entry->getLeaf();
 
-            if (lastHash == leaf.hash && leaf.data == str) {
-                deleteFromNode(entryToDeleteTo, hashToDeleteTo);
+            if (leaf.matches(lastHash, str)) {
+                deleteFromNode(arena, entryToDeleteTo, hashToDeleteTo);
                 return true;
             }
             return false;
@@ -251,6 +340,27 @@ bool TopLevelHamtNode::erase(uint64_t hash, const std::string &str) {
     }
 }
 
+TopLevelHamtNode::TopLevelHamtNode(const TopLevelHamtNode &other) {
+    for (unsigned i = 0; i < TOP_LEVEL_ENTRIES; ++i) {
+        table[i] = other.table[i].share();
+    }
+}
+
+void TopLevelHamtNode::releaseChildren() {
+    for (auto &entry: table) {
+        entry.release();
+    }
+}
+
+void *TopLevelHamtNode::operator new(size_t bytes) {
+    return ::operator new(bytes);
+}
+
+void TopLevelHamtNode::operator delete(void *p, size_t bytes) {
+    rcu::poison(p, bytes);
+    ::operator delete(p);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // HamtNodeEntry method definitions.
 //
@@ -276,6 +386,16 @@ HamtNodeEntry &HamtNodeEntry::operator=(HamtNodeEntry &&other) {
     return *this;
 }
 
+HamtNodeEntry HamtNodeEntry::share() const {
+    HamtNodeEntry result;
+    result.ptr = ptr;
+    return result;
+}
+
+bool HamtNodeEntry::sharesWith(const HamtNodeEntry &other) const {
+    return ptr == other.ptr;
+}
+
 void HamtNodeEntry::release() {
     ptr = 0;
 }
@@ -284,6 +404,10 @@ bool HamtNodeEntry::isLeaf() const {
     return ptr & 1;
 }
 
+void HamtNodeEntry::prefetchTarget() const {
+    __builtin_prefetch(reinterpret_cast<const void *>(ptr & (~1)));
+}
+
 bool HamtNodeEntry::isNull() const {
     return ptr == 0;
 }
@@ -335,8 +459,40 @@ HamtNodeEntry::~HamtNodeEntry() {
 // HamtLeaf method definitions.
 //
 
-HamtLeaf::HamtLeaf(std::string data, uint64_t hash)
-    : data(data), hash(hash) {}
+HamtLeaf::HamtLeaf(std::string_view data, uint64_t hash)
+    : hash(hash), size(data.size()) {
+    char *bytes = inlineData;
+    if (size > INLINE_KEY_BYTES) {
+        heapData = new char[size];
+        bytes = heapData;
+    }
+    std::memcpy(bytes, data.data(), size);
+}
+
+HamtLeaf::~HamtLeaf() {
+    if (size > INLINE_KEY_BYTES) {
+        rcu::poison(heapData, size);
+        delete[] heapData;
+    }
+}
+
+void *HamtLeaf::operator new(size_t bytes) {
+    return ::operator new(bytes);
+}
+
+void HamtLeaf::operator delete(void *p, size_t bytes) {
+    rcu::poison(p, bytes);
+    ::operator delete(p);
+}
+
+std::string_view HamtLeaf::data() const {
+    return std::string_view(size > INLINE_KEY_BYTES ? heapData : inlineData,
+                            size);
+}
+
+bool HamtLeaf::matches(uint64_t hash, std::string_view str) const {
+    return this->hash == hash && data() == str;
+}
 
 //////////////////////////////////////////////////////////////////////////////
 // HamtNode method definitions.
@@ -421,6 +577,58 @@ HamtNode::HamtNode(std::unique_ptr<HamtNode> node,
                 sizeof(HamtNodeEntry) * nChildren);
 }
 
+HamtNode::HamtNode(const HamtNode &node) : map(node.map) {
+    std::memcpy(&children[0],
+                &node.children[0],
+                numberOfChildren() * sizeof(HamtNodeEntry));
+}
+
+HamtNode::HamtNode(const HamtNode &node, uint64_t hash) : map(node.map) {
+    unmarkHash(hash);
+    int idx = numberOfHashesAbove(hash);
+    size_t nChildren = numberOfChildren();
+
+    // Same as the moving version, except that we leave node alone.
+    std::memcpy(&children[0],
+                &node.children[0],
+                idx * sizeof(HamtNodeEntry));
+    std::memcpy(&children[idx],
+                &node.children[idx + 1],
+                (nChildren - idx) * sizeof(HamtNodeEntry));
+}
+
+HamtNode::HamtNode(const HamtNode &node,
+                   HamtNodeEntry entry,
+                   uint64_t hash) : map(node.map) {
+    uint64_t nChildren = node.numberOfChildren();
+    assert(!containsHash(hash));
+    size_t idx = numberOfHashesAbove(hash);
+    markHash(hash);
+    std::memcpy(&children[0],
+                &node.children[0],
+                idx * sizeof(HamtNodeEntry));
+
+    new (&children[idx]) HamtNodeEntry(std::move(entry));
+
+    std::memcpy(&children[idx + 1],
+                &node.children[idx],
+                (nChildren - idx) * sizeof(HamtNodeEntry));
+}
+
+void HamtNode::overwriteChild(uint64_t hash, HamtNodeEntry entry) {
+    assert(containsHash(hash));
+    // Deliberately don't destroy the old child: it's shared.
+    new (&children[numberOfHashesAbove(hash) - 1])
+        HamtNodeEntry(std::move(entry));
+}
+
+void HamtNode::releaseChildren() {
+    int nChildren = numberOfChildren();
+    for (int i = 0; i < nChildren; ++i) {
+        children[i].release();
+    }
+}
+
 int HamtNode::numberOfChildren() const {
     return __builtin_popcountll((unsigned long long)map);
 }
@@ -449,12 +657,106 @@ HamtNode::~HamtNode() {
     }
 }
 
-void *HamtNode::operator new(size_t, int nChildren) {
-    return malloc(sizeof(HamtNode) + (nChildren - 1) * sizeof(HamtNodeEntry));
+void *HamtNode::operator new(size_t, HamtNodeArena &arena, int nChildren) {
+    return arena.allocate(nChildren);
 }
 
 void HamtNode::operator delete(void *p) {
-    free(p);
+    HamtNodeArena::deallocate(p);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// HamtNodeArena method definitions.
+//
+
+// The number of bytes a node with nChildren children takes.
+static size_t nodeBytes(int nChildren) {
+    return sizeof(HamtNode) + (nChildren - 1) * sizeof(HamtNodeEntry);
+}
+
+HamtNodeArena::HamtNodeArena() : freeLists(), remote(nullptr),
+                                 slabs(nullptr) {}
+
+HamtNodeArena::~HamtNodeArena() {
+    auto cur = slabs;
+    while (cur != nullptr) {
+        auto next = cur->nextSlab;
+        free(cur);
+        cur = next;
+    }
+}
+
+void *HamtNodeArena::allocate(int nChildren) {
+    assert(nChildren >= 1 && nChildren <= (int)TOP_LEVEL_ENTRIES);
+    auto &freeList = freeLists[nChildren - 1];
+
+    if (freeList == nullptr
+     && remote.load(std::memory_order_relaxed) != nullptr) {
+        takeRemote();
+    }
+    if (freeList == nullptr) {
+        newSlab(nChildren);
+    }
+
+    auto block = freeList;
+    freeList = block->next;
+    return block;
+}
+
+void HamtNodeArena::deallocate(void *p) {
+    auto slab = slabOf(p);
+    rcu::poison(p, nodeBytes(slab->nChildren));
+
+    auto block = static_cast<FreeBlock *>(p);
+    auto &remote = slab->arena->remote;
+
+    // takeRemote only ever takes the whole list, so this CAS is not subject
+    // to the ABA problem.
+    auto oldHead = remote.load(std::memory_order_relaxed);
+    do {
+        block->next = oldHead;
+    } while (!remote.compare_exchange_weak(oldHead, block,
+                std::memory_order_release, std::memory_order_relaxed));
+}
+
+HamtNodeArena::Slab *HamtNodeArena::slabOf(void *p) {
+    return reinterpret_cast<Slab *>(
+            reinterpret_cast<std::uintptr_t>(p) & ~(HAMT_SLAB_BYTES - 1));
+}
+
+void HamtNodeArena::takeRemote() {
+    // Synchronizes-with the CAS in deallocate, so we see the next pointers.
+    auto block = remote.exchange(nullptr, std::memory_order_acquire);
+
+    while (block != nullptr) {
+        auto next = block->next;
+        auto &freeList = freeLists[slabOf(block)->nChildren - 1];
+        block->next = freeList;
+        freeList = block;
+        block = next;
+    }
+}
+
+void HamtNodeArena::newSlab(int nChildren) {
+    auto mem = aligned_alloc(HAMT_SLAB_BYTES, HAMT_SLAB_BYTES);
+    if (mem == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    auto slab = new (mem) Slab { this, nChildren, slabs };
+    slabs = slab;
+
+    // Carve the whole slab up front; it's only ever one size.
+    auto bytes = nodeBytes(nChildren);
+    auto cur = static_cast<char *>(mem) + sizeof(Slab);
+    auto end = static_cast<char *>(mem) + HAMT_SLAB_BYTES;
+    auto &freeList = freeLists[nChildren - 1];
+
+    for (; cur + bytes <= end; cur += bytes) {
+        auto block = reinterpret_cast<FreeBlock *>(cur);
+        block->next = freeList;
+        freeList = block;
+    }
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -463,7 +765,7 @@ void HamtNode::operator delete(void *p) {
 
 void Hamt::insert(std::string &&str) {
     uint64_t hash = hasher(str);
-    root.insert(hash, std::move(str));
+    root.insert(arena, hash, std::move(str));
 }
 
 bool Hamt::find(const std::string &str) const {
@@ -473,7 +775,20 @@ bool Hamt::find(const std::string &str) const {
 
 bool Hamt::erase(const std::string &str) {
     uint64_t hash = hasher(str);
-    return root.erase(hash, str);
+    return root.erase(arena, hash, str);
+}
+
+void Hamt::findBatch(const std::string *keys, size_t nKeys,
+                     bool *found) const {
+    uint64_t hashes[HAMT_BATCH_GROUP];
+
+    for (size_t start = 0; start < nKeys; start += HAMT_BATCH_GROUP) {
+        size_t n = std::min(nKeys - start, HAMT_BATCH_GROUP);
+        for (size_t i = 0; i < n; ++i) {
+            hashes[i] = hasher(keys[start + i]);
+        }
+        root.findBatch(hashes, keys + start, n, found + start);
+    }
 }
 
 // Re-enable the warning we disabled at the start.
@@ -1,11 +1,63 @@
 #include "RCU.hh"
 
+#include <climits>
+#include <condition_variable>
+#include <cstdlib>
+#include <fstream>
+#include <list>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <linux/futex.h>
+#include <sched.h>
+
 namespace rcu {
 
-// Keep track of where the thread is in the registry.
+// Serializes grace periods, and protects globalGracePeriod.
+//
+// Registering and unregistering threads never takes this, so they never
+// wait for a grace period in progress.
+static std::mutex mutex;
+
+// The thread registry, indexed by thread index.
+//
+// Entries for indices that aren't in use have counters of 0, i.e. look like
+// quiescent threads, so synchronize can just scan every entry below
+// registryHighWater in order.
+static PerThread<PerThreadEntry> registry;
+
+// One more than the highest thread index ever used.
+static std::atomic<unsigned> registryHighWater = 0;
+
+// A bitmap of the thread indices in use.
+static std::atomic<std::uint64_t> usedThreadIndices[MAX_THREADS / 64];
+
+// The grace-period sequence number.
 //
-// This lets us deregister threads in unregisterCurrentThreads.
-static thread_local std::list<PerThreadEntry *>::iterator spotInList;
+// Incremented once when a grace period starts and once when it ends, so it is
+// odd exactly while a grace period is in progress. Callers of synchronize use
+// it to tell whether someone else already ran a full grace period on their
+// behalf.
+//
+// CAN ONLY BE MODIFIED WHILE HOLDING rcu::mutex.
+static std::atomic<std::uint64_t> gpSequence = 0;
+
+// Callbacks queued by threads that have since unregistered, one batch per
+// thread.
+//
+// CAN ONLY BE READ OR MODIFIED WHILE HOLDING orphanMutex.
+static std::mutex orphanMutex;
+static std::vector<CallbackHead *> orphanedCallbacks;
+
+// Wake the callback reclaimer for a pass, since there are callbacks to run.
+static void wakeCallbackReclaimer(void);
+
+// Hooks to run as threads unregister.
+//
+// CAN ONLY BE READ OR MODIFIED WHILE HOLDING hookMutex.
+static std::mutex hookMutex;
+static std::list<UnregisterHook *> unregisterHooks;
 
 // Wrap the membarrier syscall.
 //
@@ -22,18 +74,40 @@ static thread_local std::list<PerThreadEntry *>::iterator spotInList;
 //  - MEMBARRIER_CMD_PRIVATE_EXPEDITED: force all threads in this process to
 //    execute a full memory barrier.
 //
+// And, for synchronize, if the kernel supports it:
+//
+//  - MEMBARRIER_CMD_GLOBAL: wait until every thread on the system has
+//    executed a full memory barrier, or passed through a state that implies
+//    one. This doesn't send IPIs, but takes much longer.
+//
 static int membarrier(int cmd, int flags) {
     return syscall(__NR_membarrier, cmd, flags);
 }
 
-void membarrierAllThreads(void) {
-    // According to the docs, we don't need to check for errors here: if the
-    // call in registerCurrentProcess succeeds, all subsequent calls should
-    // succeed.
-    membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+// Wrap the futex syscall.
+//
+// We only use FUTEX_WAIT and FUTEX_WAKE on gpFutex, which is private to this
+// process. timeout is relative, and only used by FUTEX_WAIT.
+static int futex(std::atomic<std::int32_t> *addr, int op, std::int32_t val,
+                 const timespec *timeout = nullptr) {
+    return syscall(__NR_futex, reinterpret_cast<std::int32_t *>(addr),
+                   op | FUTEX_PRIVATE_FLAG, val, timeout, nullptr, 0);
+}
+
+void wakeSynchronizer(void) {
+    // Only the first reader to get here needs to make the syscall.
+    std::int32_t expected = -1;
+    if (gpFutex.compare_exchange_strong(expected, 0,
+                std::memory_order_relaxed)) {
+        futex(&gpFutex, FUTEX_WAKE, INT_MAX);
+    }
 }
 
-bool registerCurrentProcess(void) {
+// Whether the kernel supports MEMBARRIER_CMD_GLOBAL.
+static bool globalMembarrier = false;
+
+// Set up the expedited private membarrier, if the kernel supports it.
+static bool setUpMembarrier(void) {
     // Query membarrier for supported operations.
     auto ret = membarrier(MEMBARRIER_CMD_QUERY, 0);
 
@@ -42,6 +116,8 @@ bool registerCurrentProcess(void) {
         return false;
     }
 
+    globalMembarrier = ret & MEMBARRIER_CMD_GLOBAL;
+
     // Check whether the commands we'll use are supported.
     if (!(ret & MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED)) {
         return false;
@@ -70,30 +146,449 @@ bool registerCurrentProcess(void) {
     return true;
 }
 
+// Protects every registry entry's thread and signalable, so that
+// signalAllThreads never signals a thread that's gone.
+//
+// With the SIGNAL mechanism, registering and unregistering take this, so they
+// can wait for a round of signals, but still never for a grace period.
+static std::mutex signalMutex;
+
+// How many signaled threads have yet to run their barrier.
+static std::atomic<unsigned> pendingSignalAcks = 0;
+
+static void handleSignal(int) {
+    // Our memory barrier, bracketed so that it's ordered before the
+    // acknowledgement, as membarrier's would be before the syscall returns.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    pendingSignalAcks.fetch_sub(1, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+// Handle RCU_SIGNAL, unless something else already does.
+static bool setUpSignals(void) {
+    struct sigaction old;
+    if (sigaction(RCU_SIGNAL, nullptr, &old) != 0) {
+        return false;
+    }
+    // We never install an sa_sigaction handler, so any is someone else's.
+    if ((old.sa_flags & SA_SIGINFO)
+     || (old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN
+      && old.sa_handler != handleSignal)) {
+        return false;
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = handleSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(RCU_SIGNAL, &action, nullptr) == 0;
+}
+
+// Make every registered thread run a full memory barrier, and wait for them
+// to acknowledge it.
+static void signalAllThreads(void) {
+    std::unique_lock lock(signalMutex);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    auto self = threadLocalEntry;
+    auto highWater = registryHighWater.load(std::memory_order_acquire);
+    for (unsigned idx = 0; idx < highWater; ++idx) {
+        auto entry = registry.peek(idx);
+        if (entry == nullptr || entry == self || !entry->signalable) continue;
+
+        // Count the acknowledgement before it can happen.
+        pendingSignalAcks.fetch_add(1, std::memory_order_relaxed);
+        if (pthread_kill(entry->thread, RCU_SIGNAL) != 0) {
+            pendingSignalAcks.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Synchronizes-with the handlers' release decrements, so that their
+    // barriers happen-before we return.
+    for (unsigned i = 0;
+         pendingSignalAcks.load(std::memory_order_acquire) != 0; ++i) {
+        if (i < SPIN_ATTEMPTS) {
+            cpuRelax();
+        } else {
+            sched_yield();
+        }
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+// The mechanism registerCurrentProcess picked.
+static Mechanism mechanism = Mechanism::MEMBARRIER;
+
+// Make every registered thread run a full memory barrier, or act as if it
+// had, depending on the mechanism. Unless expedited, that may take a while.
+static void fenceAllThreads(bool expedited) {
+    switch (mechanism) {
+    case Mechanism::MEMBARRIER:
+        // According to the docs, we don't need to check for errors here: if
+        // the call in setUpMembarrier succeeds, all subsequent calls should
+        // succeed.
+        if (!expedited && globalMembarrier) {
+            membarrier(MEMBARRIER_CMD_GLOBAL, 0);
+        } else {
+            membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+        }
+        break;
+    case Mechanism::SIGNAL:
+        signalAllThreads();
+        break;
+    case Mechanism::FENCE:
+        // Readers run their own barriers, so we just have to run ours.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        break;
+    }
+}
+
+bool registerCurrentProcess(Mechanism preferred) {
+    static std::once_flag once;
+
+    std::call_once(once, [&] {
+        if (preferred == Mechanism::MEMBARRIER && setUpMembarrier()) {
+            mechanism = Mechanism::MEMBARRIER;
+        } else if (preferred != Mechanism::FENCE && setUpSignals()) {
+            mechanism = Mechanism::SIGNAL;
+        } else {
+            mechanism = Mechanism::FENCE;
+            readerFences = true;
+        }
+    });
+
+    return true;
+}
+
+Mechanism activeMechanism(void) {
+    return mechanism;
+}
+
+const char *mechanismName(Mechanism mechanism) {
+    switch (mechanism) {
+    case Mechanism::MEMBARRIER: return "membarrier";
+    case Mechanism::SIGNAL: return "signal";
+    case Mechanism::FENCE: return "fence";
+    }
+    return "unknown";
+}
+
+// Claim the lowest free thread index.
+//
+// Lock-free.
+static unsigned claimThreadIndex(void) {
+    for (unsigned word = 0; word < MAX_THREADS / 64; ++word) {
+        auto &bits = usedThreadIndices[word];
+        auto used = bits.load(std::memory_order_relaxed);
+
+        while (~used != 0) {
+            auto bit = __builtin_ctzll(~used);
+            if (bits.compare_exchange_weak(used, used | (1ULL << bit),
+                        std::memory_order_acquire,
+                        std::memory_order_relaxed)) {
+                return word * 64 + bit;
+            }
+        }
+    }
+
+    assert(!"More than MAX_THREADS threads registered");
+    abort();
+}
+
 void registerCurrentThread(void) {
-    std::unique_lock lock(mutex);
-    // Our gracePeriodCounter starts at 0.
-    threadLocalEntry.gracePeriodCounter.store(0,
-            std::memory_order_relaxed);
-    entries.push_back(&threadLocalEntry);
-    // Remember where we are in the list. This is only used for
-    // unregistration.
-    spotInList = entries.end();
-    spotInList--;
+    auto idx = claimThreadIndex();
+    auto &entry = registry.get(idx);
+
+    // Our gracePeriodCounter starts at 0, and we start offline.
+    entry.gracePeriodCounter.store(0, std::memory_order_relaxed);
+    entry.qsbrCounter.store(0, std::memory_order_relaxed);
+    entry.callbacks.store(nullptr, std::memory_order_relaxed);
+    entry.index = idx;
+    entry.tid.store(syscall(SYS_gettid), std::memory_order_relaxed);
+    threadLocalEntry = &entry;
+
+    if (mechanism == Mechanism::SIGNAL) {
+        std::unique_lock lock(signalMutex);
+        entry.thread = pthread_self();
+        entry.signalable = true;
+    }
+
+    // Make sure synchronize scans far enough to see us.
+    auto highWater = registryHighWater.load(std::memory_order_relaxed);
+    while (highWater <= idx
+        && !registryHighWater.compare_exchange_weak(highWater, idx + 1,
+                std::memory_order_release, std::memory_order_relaxed)) {}
 }
 
 void unregisterCurrentThread(void) {
-    std::unique_lock lock(mutex);
-    entries.erase(spotInList);
+    auto entry = threadLocalEntry;
+
+    {
+        std::unique_lock lock(hookMutex);
+        for (const auto &hook: unregisterHooks) {
+            hook->func(hook->arg);
+        }
+    }
+
+    // Hand any callbacks we still have queued to the reclaimer.
+    auto callbacks = entry->callbacks.exchange(nullptr,
+            std::memory_order_acquire);
+    if (callbacks != nullptr) {
+        {
+            std::unique_lock lock(orphanMutex);
+            orphanedCallbacks.push_back(callbacks);
+        }
+        wakeCallbackReclaimer();
+    }
+
+    threadOffline();
+
+    if (mechanism == Mechanism::SIGNAL) {
+        std::unique_lock lock(signalMutex);
+        entry->signalable = false;
+    }
+
+    threadLocalEntry = nullptr;
+
+    // The index is free for reuse as soon as we clear its bit.
+    auto idx = entry->index;
+    usedThreadIndices[idx / 64].fetch_and(~(1ULL << (idx % 64)),
+            std::memory_order_release);
 }
 
-static inline void toggleAndWaitForThreads(void);
-void synchronize(void) {
+void addUnregisterHook(UnregisterHook *hook) {
+    std::unique_lock lock(hookMutex);
+    unregisterHooks.push_back(hook);
+}
+
+void removeUnregisterHook(UnregisterHook *hook) {
+    std::unique_lock lock(hookMutex);
+    unregisterHooks.remove(hook);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// NUMA topology.
+//
+
+// Call f on each ID in a sysfs list file like "0-3,8,10-11". Returns false if
+// the file can't be read or parsed.
+template<typename F>
+static bool forEachListedId(const std::string &path, F f) {
+    std::ifstream file(path);
+    std::string list;
+    if (!std::getline(file, list)) return false;
+
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end;
+        unsigned long first, last;
+        try {
+            first = last = std::stoul(list.substr(pos), &end);
+            pos += end;
+            if (pos < list.size() && list[pos] == '-') {
+                last = std::stoul(list.substr(pos + 1), &end);
+                pos += end + 1;
+            }
+        } catch (const std::exception &) {
+            return false;
+        }
+
+        for (auto id = first; id <= last; ++id) {
+            f(id);
+        }
+        if (pos < list.size() && list[pos] == ',') pos++;
+    }
+
+    return true;
+}
+
+unsigned numaNodeCount(void) {
+    static const unsigned count = [] {
+        unsigned result = 1;
+        forEachListedId("/sys/devices/system/node/online",
+                        [&](unsigned long node) {
+            result = std::max<unsigned>(result, std::min<unsigned long>(
+                    node + 1, MAX_NUMA_NODES));
+        });
+        return result;
+    }();
+    return count;
+}
+
+unsigned currentNumaNode(void) {
+    unsigned cpu, node;
+    if (getcpu(&cpu, &node) != 0) return 0;
+    return std::min(node, MAX_NUMA_NODES - 1);
+}
+
+bool pinToNumaNode(unsigned node) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    bool any = false;
+
+    auto path = "/sys/devices/system/node/node" + std::to_string(node)
+              + "/cpulist";
+    forEachListedId(path, [&](unsigned long cpu) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &cpus);
+            any = true;
+        }
+    });
+
+    return any
+        && pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Stall detection.
+//
+
+// 0 when detection is off.
+static std::atomic<std::int64_t> stallTimeoutNs =
+    std::chrono::nanoseconds(DEFAULT_STALL_TIMEOUT).count();
+static std::atomic<StallHandler> stallHandler = nullptr;
+static std::atomic<std::uint64_t> stallCount = 0;
+
+class StallWatch;
+
+// The latest stall report, and the watch that made it, or nullptr if no
+// grace period is waiting on a stalled reader.
+//
+// CAN ONLY BE READ OR MODIFIED WHILE HOLDING stallMutex.
+static std::mutex stallMutex;
+static const StallWatch *currentStallWatch = nullptr;
+static ReaderStall currentStall;
+
+void setStallDetector(std::chrono::nanoseconds timeout,
+                      StallHandler handler) {
+    stallHandler.store(handler, std::memory_order_relaxed);
+    stallTimeoutNs.store(std::max<std::int64_t>(0, timeout.count()),
+                         std::memory_order_relaxed);
+}
+
+StallStats stallStats(void) {
+    std::unique_lock lock(stallMutex);
+    return StallStats {
+        stallCount.load(std::memory_order_relaxed),
+        currentStallWatch != nullptr, currentStall
+    };
+}
+
+// Times a synchronizer's wait on a single reader, reporting it each time it
+// goes on for another stall timeout.
+//
+// Waits only start one once they're done spinning and yielding, so that the
+// fast paths don't even read the clock. Stall timeouts are far longer than
+// that takes anyway.
+class StallWatch {
+public:
+    explicit StallWatch(const PerThreadEntry *entry)
+        : entry(entry), start(std::chrono::steady_clock::now()), reports(0) {}
+
+    ~StallWatch() {
+        if (reports == 0) return;
+
+        std::unique_lock lock(stallMutex);
+        if (currentStallWatch == this) {
+            currentStallWatch = nullptr;
+        }
+    }
+
+    StallWatch(const StallWatch &) = delete;
+    StallWatch &operator=(const StallWatch &) = delete;
+
+    // Report the wait if it's due.
+    void check(void) {
+        auto timeout = stallTimeout();
+        if (timeout.count() == 0) return;
+
+        auto waited = std::chrono::steady_clock::now() - start;
+        if (waited < timeout * (reports + 1)) return;
+
+        if (reports == 0) {
+            stallCount.fetch_add(1, std::memory_order_relaxed);
+        }
+        reports = waited / timeout;
+
+        ReaderStall stall {
+            entry->index, entry->tid.load(std::memory_order_relaxed),
+            std::chrono::duration_cast<std::chrono::nanoseconds>(waited)
+        };
+        {
+            std::unique_lock lock(stallMutex);
+            currentStallWatch = this;
+            currentStall = stall;
+        }
+
+        auto handler = stallHandler.load(std::memory_order_relaxed);
+        if (handler != nullptr) handler(stall);
+    }
+
+    // How long a blocking wait may last before check needs calling, or a
+    // negative duration if never.
+    std::chrono::nanoseconds untilNextCheck(void) const {
+        auto timeout = stallTimeout();
+        if (timeout.count() == 0) return std::chrono::nanoseconds(-1);
+
+        auto due = start + timeout * (reports + 1);
+        return std::max(std::chrono::nanoseconds(0),
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                due - std::chrono::steady_clock::now()));
+    }
+
+private:
+    static std::chrono::nanoseconds stallTimeout(void) {
+        return std::chrono::nanoseconds(
+                stallTimeoutNs.load(std::memory_order_relaxed));
+    }
+
+    const PerThreadEntry *entry;
+    std::chrono::steady_clock::time_point start;
+    // How many timeouts' worth of waiting we've reported so far.
+    std::int64_t reports;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Grace periods.
+//
+
+static inline void toggleAndWaitForThreads(bool expedited);
+
+// Wait for a grace period, run with expedited barriers or not.
+static void waitForGracePeriod(bool expedited) {
+    auto start = statsClock();
+
+    // Order our caller's prior updates before reading the sequence number.
+    // Pairs with the first fenceAllThreads below: if we read a stale
+    // sequence number, the grace period that incremented it must see those
+    // updates.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto seq = gpSequence.load(std::memory_order_relaxed);
+    // The sequence number at which a grace period that started after we got
+    // here will have ended. If one is in progress right now, that's the end
+    // of the next one.
+    auto needed = (seq + 3) & ~1ULL;
+
     std::unique_lock lock(mutex);
+
+    // While we waited for the mutex, someone else may have run a whole grace
+    // period for us. Acquiring the mutex they released makes everything that
+    // grace period guarantees visible to us, so we can just return.
+    seq = gpSequence.load(std::memory_order_relaxed);
+    if (seq >= needed) {
+        addStat(Stat::SHARED_GRACE_PERIODS);
+        recordLatency(Latency::GRACE_PERIOD, statsClock() - start);
+        return;
+    }
+
+    gpSequence.store(seq + 1, std::memory_order_relaxed);
+
     // Wait until all reader threads have run a full memory barrier. In effect
     // this synchronizes-with the notional "memory barriers" in readLock and
     // readUnlock.
-    membarrierAllThreads();
+    fenceAllThreads(expedited);
     // Toggle the GP bit and wait until every thread has either entered a
     // quiescent state, or matches the new GP bit. If a thread has entered a
     // quiescent state, then we're good as far as that thread is concerned.
@@ -105,38 +600,378 @@ void synchronize(void) {
     //    synchronize.
     //
     // To rule out the latter case...
-    toggleAndWaitForThreads();
+    toggleAndWaitForThreads(expedited);
     // we toggle the bit again and perform the same check.
-    toggleAndWaitForThreads();
-    // Similar to the membarrierAllThreads above. This one ensures that reader
+    toggleAndWaitForThreads(expedited);
+    // Similar to the fenceAllThreads above. This one ensures that reader
     // threads' reads of shared data happen-before we return.
-    membarrierAllThreads();
+    fenceAllThreads(expedited);
+
+    gpSequence.store(seq + 2, std::memory_order_relaxed);
+
+    addStat(Stat::GRACE_PERIODS);
+    recordLatency(Latency::GRACE_PERIOD, statsClock() - start);
+}
+
+void synchronize(void) {
+    waitForGracePeriod(false);
+}
+
+void synchronizeExpedited(void) {
+    waitForGracePeriod(true);
+}
+
+// Whether we can stop waiting on the given thread.
+//
+// True if it is in a quiescent state, or its thread-local GP bit matches
+// newGracePeriod.
+static inline bool readerDone(const PerThreadEntry *entry,
+                              std::uint64_t newGracePeriod) {
+    auto entryGP = entry->gracePeriodCounter.load(
+            std::memory_order_relaxed);
+    if (!(entryGP & NESTING_MASK))
+        return true;
+    return (entryGP & GP_COUNTER_MASK) == (newGracePeriod & GP_COUNTER_MASK);
+}
+
+// Wait until readerDone(entry, newGracePeriod).
+//
+// Readers usually leave their critical sections quickly, so first we spin,
+// then we yield the CPU, and only then do we park on gpFutex until some
+// reader leaves its outermost critical section, or it's time to check for a
+// stall.
+static void waitForReader(const PerThreadEntry *entry,
+                          std::uint64_t newGracePeriod, bool expedited) {
+    if (readerDone(entry, newGracePeriod)) return;
+    addStat(Stat::READER_WAITS);
+
+    for (unsigned i = 0; i < SPIN_ATTEMPTS; ++i) {
+        addStat(Stat::READER_SPINS);
+        cpuRelax();
+        if (readerDone(entry, newGracePeriod)) return;
+    }
+
+    for (unsigned i = 0; i < YIELD_ATTEMPTS; ++i) {
+        addStat(Stat::READER_YIELDS);
+        sched_yield();
+        if (readerDone(entry, newGracePeriod)) return;
+    }
+
+    StallWatch watch(entry);
+
+    // Waking us would cost FENCE readers a memory barrier on every outermost
+    // readUnlock, so poll instead.
+    if (mechanism == Mechanism::FENCE) {
+        while (!readerDone(entry, newGracePeriod)) {
+            addStat(Stat::READER_SLEEPS);
+            std::this_thread::sleep_for(POLL_INTERVAL);
+            watch.check();
+        }
+        return;
+    }
+
+    while (true) {
+        gpFutex.store(-1, std::memory_order_relaxed);
+        // Pairs with the signal fence in readUnlock. After this, either the
+        // reader's nesting store is visible to us, or its subsequent load of
+        // gpFutex will see the -1 and wake us.
+        fenceAllThreads(expedited);
+
+        if (readerDone(entry, newGracePeriod)) {
+            gpFutex.store(0, std::memory_order_relaxed);
+            return;
+        }
+
+        // Returns immediately if a reader already reset gpFutex to 0.
+        addStat(Stat::READER_SLEEPS);
+        auto wait = watch.untilNextCheck();
+        if (wait.count() < 0) {
+            futex(&gpFutex, FUTEX_WAIT, -1);
+        } else {
+            timespec timeout {
+                static_cast<time_t>(wait.count() / 1000000000),
+                static_cast<long>(wait.count() % 1000000000)
+            };
+            futex(&gpFutex, FUTEX_WAIT, -1, &timeout);
+        }
+        watch.check();
+    }
 }
 
 // Toggle the GP bit and wait until we observe one of two things for every
 // thread:
 //  - They are in a quiescent state.
 //  - Their thread-local GP bit matcches the global one.
-void toggleAndWaitForThreads(void) {
-    using namespace std::literals;
-
+void toggleAndWaitForThreads(bool expedited) {
     auto oldGracePeriod = globalGracePeriod.load(
             std::memory_order_relaxed);
     auto newGracePeriod = oldGracePeriod ^ GP_COUNTER_MASK;
     globalGracePeriod.store(newGracePeriod,
             std::memory_order_relaxed);
 
-    for (const auto &entry: entries) {
+    auto highWater = registryHighWater.load(std::memory_order_acquire);
+    for (unsigned idx = 0; idx < highWater; ++idx) {
+        auto entry = registry.peek(idx);
+        if (entry != nullptr) {
+            waitForReader(entry, newGracePeriod, expedited);
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// QSBR grace periods.
+//
+
+// Wait until the thread is offline, or has announced a quiescent state since
+// grace period target started.
+static void waitForQsbrThread(const PerThreadEntry *entry,
+                              std::uint64_t target) {
+    // Synchronizes-with the release stores in quiescentState and
+    // threadOffline.
+    auto done = [&] {
+        auto counter = entry->qsbrCounter.load(std::memory_order_acquire);
+        return counter == 0 || counter >= target;
+    };
+
+    if (done()) return;
+    addStat(Stat::READER_WAITS);
+
+    for (unsigned i = 0; i < SPIN_ATTEMPTS; ++i) {
+        addStat(Stat::READER_SPINS);
+        cpuRelax();
+        if (done()) return;
+    }
+
+    for (unsigned i = 0; i < YIELD_ATTEMPTS; ++i) {
+        addStat(Stat::READER_YIELDS);
+        sched_yield();
+        if (done()) return;
+    }
+
+    StallWatch watch(entry);
+    while (!done()) {
+        addStat(Stat::READER_SLEEPS);
+        std::this_thread::sleep_for(POLL_INTERVAL);
+        watch.check();
+    }
+}
+
+void QsbrFlavor::synchronize(void) {
+    auto start = statsClock();
+    addStat(Stat::QSBR_GRACE_PERIODS);
+
+    // Starting a new grace period is all it takes: a thread that announces a
+    // quiescent state after this sees at least target. Concurrent callers
+    // each start one, and a single announcement satisfies all of them.
+    //
+    // The release half synchronizes-with the acquire loads in quiescentState
+    // and threadOnline, so that readers who see target also see what our
+    // caller unlinked.
+    auto target = qsbrGracePeriod.fetch_add(1, std::memory_order_acq_rel)
+                + 1;
+    // Pairs with the fence in threadOnline.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    auto self = threadLocalEntry;
+    auto highWater = registryHighWater.load(std::memory_order_acquire);
+    for (unsigned idx = 0; idx < highWater; ++idx) {
+        auto entry = registry.peek(idx);
+        if (entry != nullptr && entry != self) {
+            waitForQsbrThread(entry, target);
+        }
+    }
+
+    if (self != nullptr && isOnline()) {
+        quiescentState();
+    }
+
+    recordLatency(Latency::QSBR_GRACE_PERIOD, statsClock() - start);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Deferred callbacks.
+//
+
+// Runs the callbacks queued by call.
+//
+// There is one of these per process. It is started by the first call to call
+// or barrier and stopped, after running whatever is left, at process exit.
+//
+// It sleeps until woken: by call when a thread's batch goes from empty to
+// not, by threads unregistering with callbacks still queued, and by barrier.
+class CallbackReclaimer {
+public:
+    static CallbackReclaimer &get(void) {
+        static CallbackReclaimer reclaimer;
+        return reclaimer;
+    }
+
+    // Wait for a full pass of the reclaimer that started after we got here.
+    void waitForPass(void) {
+        std::unique_lock lock(passMutex);
+        // Passes work like grace periods in synchronize: passSequence is odd
+        // exactly while one is in progress.
+        auto needed = (passSequence + 3) & ~1ULL;
+        // Only now, so that the pass we wake can't be one that started
+        // before we got here.
+        wake();
+        passDone.wait(lock, [&] { return passSequence >= needed; });
+    }
+
+    // Make sure another pass starts after this.
+    void wake(void) {
+        {
+            std::unique_lock lock(wakeMutex);
+            woken = true;
+        }
+        wakeup.notify_one();
+    }
+
+    ~CallbackReclaimer() {
+        {
+            std::unique_lock lock(wakeMutex);
+            done = true;
+        }
+        wakeup.notify_one();
+        thread.join();
+    }
+
+private:
+    CallbackReclaimer()
+        : passSequence(0), woken(false), done(false),
+          thread(reclaimLoop, this) {}
+
+    static void reclaimLoop(CallbackReclaimer *reclaimer) {
+        registerCurrentThread();
+
         while (true) {
-            auto entryGP = entry->gracePeriodCounter.load(
-                    std::memory_order_relaxed);
-            if (!(entryGP & NESTING_MASK))
-                break;
-            if ((entryGP & GP_COUNTER_MASK) == (newGracePeriod & GP_COUNTER_MASK))
-                break;
-            std::this_thread::sleep_for(1ms);
+            {
+                std::unique_lock lock(reclaimer->wakeMutex);
+                reclaimer->wakeup.wait(lock, [&] {
+                    return reclaimer->done || reclaimer->woken;
+                });
+                if (reclaimer->done) break;
+                // Anything queued from here on wakes us again.
+                reclaimer->woken = false;
+            }
+
+            reclaimer->runPass();
         }
+
+        // Callbacks may queue more callbacks, so keep going until there is
+        // nothing left.
+        while (reclaimer->runPass()) {}
+
+        unregisterCurrentThread();
     }
+
+    // Collect every queued callback, wait for a grace period, and run them.
+    //
+    // Returns whether there were any callbacks to run.
+    bool runPass(void) {
+        {
+            std::unique_lock lock(passMutex);
+            passSequence++;
+        }
+
+        // One batch per thread, each most recent first.
+        std::vector<CallbackHead *> batches;
+        auto highWater = registryHighWater.load(std::memory_order_acquire);
+        for (unsigned idx = 0; idx < highWater; ++idx) {
+            auto entry = registry.peek(idx);
+            if (entry == nullptr) continue;
+
+            // Synchronizes-with the committing CAS in call, so that we see
+            // each callback's next and func.
+            auto batch = entry->callbacks.exchange(nullptr,
+                    std::memory_order_acquire);
+            if (batch != nullptr) {
+                batches.push_back(batch);
+            }
+        }
+        {
+            std::unique_lock lock(orphanMutex);
+            batches.insert(batches.end(), orphanedCallbacks.begin(),
+                           orphanedCallbacks.end());
+            orphanedCallbacks.clear();
+        }
+
+        if (!batches.empty()) {
+            // One grace period covers every batch.
+            synchronize();
+
+            for (auto batch: batches) {
+                // Reverse the batch so we run callbacks in the order they
+                // were queued.
+                CallbackHead *inOrder = nullptr;
+                while (batch != nullptr) {
+                    auto next = batch->next;
+                    batch->next = inOrder;
+                    inOrder = batch;
+                    batch = next;
+                }
+
+                while (inOrder != nullptr) {
+                    // The callback may free inOrder.
+                    auto next = inOrder->next;
+                    inOrder->func(inOrder);
+                    inOrder = next;
+                }
+            }
+        }
+
+        {
+            std::unique_lock lock(passMutex);
+            passSequence++;
+        }
+        passDone.notify_all();
+
+        return !batches.empty();
+    }
+
+    std::mutex passMutex;
+    std::condition_variable passDone;
+    // CAN ONLY BE READ OR MODIFIED WHILE HOLDING passMutex.
+    std::uint64_t passSequence;
+    std::mutex wakeMutex;
+    std::condition_variable wakeup;
+    // CAN ONLY BE READ OR MODIFIED WHILE HOLDING wakeMutex.
+    bool woken;
+    bool done;
+    // Declared last so that the thread only starts once the fields it reads
+    // are initialized.
+    std::thread thread;
+};
+
+static void wakeCallbackReclaimer(void) {
+    CallbackReclaimer::get().wake();
+}
+
+void call(CallbackHead *head, void (*func)(CallbackHead *)) {
+    // Make sure someone is around to run the callback.
+    auto &reclaimer = CallbackReclaimer::get();
+
+    head->func = func;
+
+    auto &callbacks = threadLocalEntry->callbacks;
+    auto oldHead = callbacks.load(std::memory_order_relaxed);
+    // Only this thread ever pushes onto this batch, and the reclaimer only
+    // ever takes the whole thing, so this CAS is not subject to the ABA
+    // problem and only fails if it races with the reclaimer.
+    do {
+        head->next = oldHead;
+    } while (!callbacks.compare_exchange_weak(oldHead, head,
+                std::memory_order_release, std::memory_order_relaxed));
+
+    // The reclaimer takes whole batches, so a non-empty one is already
+    // due a pass that hasn't collected it yet.
+    if (oldHead == nullptr) {
+        reclaimer.wake();
+    }
+}
+
+void barrier(void) {
+    CallbackReclaimer::get().waitForPass();
 }
 
 }
@@ -0,0 +1,567 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "RCU.hh"
+#include "RcuHamt.hh"
+
+#define UNLIKELY(condition) __builtin_expect(static_cast<bool>(condition), 0)
+
+//////////////////////////////////////////////////////////////////////////////
+// Retiring old versions.
+//
+
+// Whether any version in pinned is from created up to, but not including,
+// replacedIn, and so may reach a node created and replaced in those
+// versions.
+static bool isReachable(const std::map<uint64_t, unsigned> &pinned,
+                        uint64_t created, uint64_t replacedIn) {
+    auto it = pinned.lower_bound(created);
+    return it != pinned.end() && it->first < replacedIn;
+}
+
+// Move everything in from that no version in pinned can reach to to.
+template<typename T>
+static void moveUnreachable(const std::map<uint64_t, unsigned> &pinned,
+                            uint64_t replacedIn, std::vector<T *> &from,
+                            std::vector<T *> &to) {
+    size_t kept = 0;
+    for (auto t: from) {
+        if (isReachable(pinned, t->version, replacedIn)) {
+            from[kept++] = t;
+        } else {
+            to.push_back(t);
+        }
+    }
+    from.resize(kept);
+}
+
+// Everything a single insert or erase replaced, to be freed once no reader
+// can still be using it, and no Snapshot can still reach it.
+//
+// Nodes and the root are freed shallowly, since their children are either
+// shared with the new version or retired themselves.
+struct RetiredHamtNodes : rcu::CallbackHead {
+    RetiredHamtNodes(const RcuHamt *hamt, uint64_t replacedIn)
+        : hamt(hamt), replacedIn(replacedIn) {}
+
+    RetiredHamtNodes(const RetiredHamtNodes &) = delete;
+    RetiredHamtNodes &operator=(const RetiredHamtNodes &) = delete;
+
+    ~RetiredHamtNodes() {
+        if (root != nullptr) {
+            root->releaseChildren();
+            delete root;
+        }
+        for (auto node: nodes) {
+            node->releaseChildren();
+            delete node;
+        }
+        for (auto leaf: leaves) {
+            delete leaf;
+        }
+    }
+
+    size_t size() const {
+        return (root != nullptr) + nodes.size() + leaves.size();
+    }
+
+    // Move everything no version in pinned can reach to unheld.
+    void moveUnheld(const std::map<uint64_t, unsigned> &pinned,
+                    RetiredHamtNodes &unheld) {
+        if (root != nullptr
+         && !isReachable(pinned, root->version, replacedIn)) {
+            unheld.root = root;
+            root = nullptr;
+        }
+        moveUnreachable(pinned, replacedIn, nodes, unheld.nodes);
+        moveUnreachable(pinned, replacedIn, leaves, unheld.leaves);
+    }
+
+    static void reclaim(rcu::CallbackHead *head) {
+        auto retired = static_cast<RetiredHamtNodes *>(head);
+        retired->hamt->reclaim(retired);
+    }
+
+    const RcuHamt *hamt;
+    // The version that replaced everything here. It's also the version the
+    // replacements are created in.
+    uint64_t replacedIn;
+    TopLevelHamtNode *root = nullptr;
+    std::vector<HamtNode *> nodes;
+    std::vector<HamtLeaf *> leaves;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Path copying.
+//
+// Each of these builds the replacement for a single entry of the current
+// version out of nodes from arena, without modifying anything reachable from
+// it, and records what the replacement supersedes in retired. depth is the
+// entry's level (0 in the top-level node), and hash is the key's hash as of
+// that level. Everything new is stamped with the version being built.
+//
+
+// The key's hash as of level, given its hash as of the level above.
+static uint64_t nextHash(uint64_t hash, unsigned level,
+                         std::string_view str) {
+    if (UNLIKELY(level >= LEVELS_PER_HASH)
+     && (level % LEVELS_PER_HASH) == 0) {
+        return getNthBackup(str, level / LEVELS_PER_HASH - 1);
+    }
+    return hash >> BITS_PER_LEVEL;
+}
+
+// A leaf for the key str, whose hash as of its level is hash.
+static std::unique_ptr<HamtLeaf> newLeaf(std::string_view str, uint64_t hash,
+                                         uint64_t version) {
+    auto leaf = std::make_unique<HamtLeaf>(str, hash);
+    leaf->version = version;
+    return leaf;
+}
+
+// An entry at depth holding both leaves, which have the same hash as of
+// depth.
+static HamtNodeEntry splitLeaves(HamtNodeArena &arena, unsigned depth,
+                                 uint64_t version,
+                                 std::unique_ptr<HamtLeaf> a,
+                                 std::unique_ptr<HamtLeaf> b) {
+    a->hash = nextHash(a->hash, depth + 1, a->data());
+    b->hash = nextHash(b->hash, depth + 1, b->data());
+    auto aHash = a->hash;
+    auto bHash = b->hash;
+
+    if ((aHash & FIRST_N_BITS) != (bHash & FIRST_N_BITS)) {
+        std::unique_ptr<HamtNode> node(
+                new (arena, 2) HamtNode(aHash, HamtNodeEntry(std::move(a)),
+                                        bHash, HamtNodeEntry(std::move(b))));
+        node->version = version;
+        return HamtNodeEntry(std::move(node));
+    }
+
+    auto child = splitLeaves(arena, depth + 1, version, std::move(a),
+                             std::move(b));
+    std::unique_ptr<HamtNode> node(
+            new (arena, 1) HamtNode(aHash, std::move(child)));
+    node->version = version;
+    return HamtNodeEntry(std::move(node));
+}
+
+// The replacement for entry with str inserted, or a null entry if str is
+// already there.
+static HamtNodeEntry insertAt(HamtNodeArena &arena, HamtNodeEntry &entry,
+                              unsigned depth, uint64_t hash,
+                              const std::string &str,
+                              RetiredHamtNodes &retired) {
+    if (entry.isNull()) {
+        return HamtNodeEntry(newLeaf(str, hash, retired.replacedIn));
+    }
+
+    if (entry.isLeaf()) {
+        auto &leaf = entry.getLeaf();
+        if (leaf.matches(hash, str)) {
+            return HamtNodeEntry();
+        }
+
+        // Readers may still be looking at leaf, so push a copy of it down
+        // instead of updating its hash in place.
+        retired.leaves.push_back(&leaf);
+        return splitLeaves(arena, depth, retired.replacedIn,
+                           newLeaf(leaf.data(), leaf.hash,
+                                   retired.replacedIn),
+                           newLeaf(str, hash, retired.replacedIn));
+    }
+
+    auto &node = entry.getChild();
+    auto childHash = nextHash(hash, depth + 1, str);
+    std::unique_ptr<HamtNode> newNode;
+
+    if (node.containsHash(childHash)) {
+        auto &child = node.children[node.numberOfHashesAbove(childHash) - 1];
+        auto newChild = insertAt(arena, child, depth + 1, childHash, str,
+                                 retired);
+        if (newChild.isNull()) {
+            return HamtNodeEntry();
+        }
+
+        newNode.reset(new (arena, node.numberOfChildren()) HamtNode(node));
+        newNode->overwriteChild(childHash, std::move(newChild));
+    } else {
+        auto leaf = newLeaf(str, childHash, retired.replacedIn);
+        newNode.reset(new (arena, node.numberOfChildren() + 1)
+                HamtNode(node, HamtNodeEntry(std::move(leaf)), childHash));
+    }
+
+    newNode->version = retired.replacedIn;
+    retired.nodes.push_back(&node);
+    return HamtNodeEntry(std::move(newNode));
+}
+
+// Set replacement to entry with str erased (a null entry if nothing is
+// left). Returns false, leaving replacement alone, if str isn't there.
+static bool eraseAt(HamtNodeArena &arena, HamtNodeEntry &entry,
+                    unsigned depth, uint64_t hash, const std::string &str,
+                    HamtNodeEntry &replacement, RetiredHamtNodes &retired) {
+    if (entry.isNull()) {
+        return false;
+    }
+
+    if (entry.isLeaf()) {
+        auto &leaf = entry.getLeaf();
+        if (!leaf.matches(hash, str)) {
+            return false;
+        }
+
+        retired.leaves.push_back(&leaf);
+        replacement = HamtNodeEntry();
+        return true;
+    }
+
+    auto &node = entry.getChild();
+    auto childHash = nextHash(hash, depth + 1, str);
+    if (!node.containsHash(childHash)) {
+        return false;
+    }
+
+    auto &child = node.children[node.numberOfHashesAbove(childHash) - 1];
+    HamtNodeEntry newChild;
+    if (!eraseAt(arena, child, depth + 1, childHash, str, newChild,
+                 retired)) {
+        return false;
+    }
+
+    if (!newChild.isNull()) {
+        std::unique_ptr<HamtNode> newNode(
+                new (arena, node.numberOfChildren()) HamtNode(node));
+        newNode->overwriteChild(childHash, std::move(newChild));
+        newNode->version = retired.replacedIn;
+        replacement = HamtNodeEntry(std::move(newNode));
+    } else if (node.numberOfChildren() > 1) {
+        std::unique_ptr<HamtNode> newNode(
+                new (arena, node.numberOfChildren() - 1)
+                HamtNode(node, childHash));
+        newNode->version = retired.replacedIn;
+        replacement = HamtNodeEntry(std::move(newNode));
+    } else {
+        replacement = HamtNodeEntry();
+    }
+
+    retired.nodes.push_back(&node);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// RcuHamt method definitions.
+//
+
+RcuHamt::RcuHamt() : root(new TopLevelHamtNode()) {}
+
+RcuHamt::~RcuHamt() {
+    // Retired nodes go back to arena once their grace period is up, so wait
+    // for that before arena is destroyed. With no Snapshots left, none are
+    // held back.
+    rcu::barrier();
+    assert(pinned.empty() && held.empty());
+
+    // Anything that was retired was released from the current version, so
+    // this doesn't double-free anything.
+    delete root.load(std::memory_order_relaxed);
+}
+
+void RcuHamt::insert(std::string &&str) {
+    uint64_t hash = hasher(str);
+    unsigned idx = hash & FIRST_N_BITS;
+
+    std::lock_guard<std::mutex> lock(writeMutex);
+    // Only writers store to root, and we hold the lock.
+    auto oldRoot = root.load(std::memory_order_relaxed);
+
+    auto retired = std::make_unique<RetiredHamtNodes>(
+            this, oldRoot->version + 1);
+    auto entry = insertAt(arena, oldRoot->table[idx], 0, hash, str,
+                          *retired);
+    if (entry.isNull()) {
+        return;
+    }
+
+    publish(oldRoot, idx, std::move(entry), retired.release());
+}
+
+bool RcuHamt::find(const std::string &str) const {
+    uint64_t hash = hasher(str);
+
+    rcu::ReadGuard guard;
+    rcu::Protected<TopLevelHamtNode *> current(root);
+    return current->find(hash, str);
+}
+
+void RcuHamt::findBatch(const std::string *keys, size_t nKeys,
+                        bool *found) const {
+    uint64_t hashes[HAMT_BATCH_GROUP];
+
+    for (size_t start = 0; start < nKeys; start += HAMT_BATCH_GROUP) {
+        size_t n = std::min(nKeys - start, HAMT_BATCH_GROUP);
+        for (size_t i = 0; i < n; ++i) {
+            hashes[i] = hasher(keys[start + i]);
+        }
+
+        // A critical section per group, so that huge batches don't hold up
+        // grace periods.
+        rcu::ReadGuard guard;
+        rcu::Protected<TopLevelHamtNode *> current(root);
+        current->findBatch(hashes, keys + start, n, found + start);
+    }
+}
+
+bool RcuHamt::erase(const std::string &str) {
+    uint64_t hash = hasher(str);
+    unsigned idx = hash & FIRST_N_BITS;
+
+    std::lock_guard<std::mutex> lock(writeMutex);
+    auto oldRoot = root.load(std::memory_order_relaxed);
+
+    auto retired = std::make_unique<RetiredHamtNodes>(
+            this, oldRoot->version + 1);
+    HamtNodeEntry entry;
+    if (!eraseAt(arena, oldRoot->table[idx], 0, hash, str, entry,
+                 *retired)) {
+        return false;
+    }
+
+    publish(oldRoot, idx, std::move(entry), retired.release());
+    return true;
+}
+
+void RcuHamt::publish(TopLevelHamtNode *oldRoot, unsigned idx,
+                      HamtNodeEntry entry, RetiredHamtNodes *retired) {
+    auto newRoot = new TopLevelHamtNode(*oldRoot);
+    newRoot->version = retired->replacedIn;
+
+    // The shared entry belongs to oldRoot; assigning over it would destroy
+    // it.
+    newRoot->table[idx].release();
+    newRoot->table[idx] = std::move(entry);
+
+    // Pairs with the acquire load in find, so readers see the new nodes fully
+    // constructed.
+    root.store(newRoot, std::memory_order_release);
+
+    retired->root = oldRoot;
+    rcu::call(retired, RetiredHamtNodes::reclaim);
+}
+
+RcuHamt::Snapshot RcuHamt::snapshot() const {
+    rcu::ReadGuard guard;
+    rcu::Protected<TopLevelHamtNode *> current(root);
+
+    // Nothing current can reach has been reclaimed yet, and since we're in
+    // a critical section, nothing will be until after we've pinned it.
+    {
+        std::lock_guard<std::mutex> lock(snapshotMutex);
+        pinned[current->version]++;
+    }
+    return Snapshot(this, current.get());
+}
+
+size_t RcuHamt::heldNodeCount() const {
+    std::lock_guard<std::mutex> lock(snapshotMutex);
+
+    size_t result = 0;
+    for (auto retired: held) {
+        result += retired->size();
+    }
+    return result;
+}
+
+void RcuHamt::unpin(uint64_t version) const {
+    // Freed once we've let go of the lock.
+    std::vector<std::unique_ptr<RetiredHamtNodes>> unheld;
+
+    std::lock_guard<std::mutex> lock(snapshotMutex);
+    auto it = pinned.find(version);
+    if (--it->second > 0) {
+        return;
+    }
+    pinned.erase(it);
+
+    size_t kept = 0;
+    for (auto retired: held) {
+        auto free = std::make_unique<RetiredHamtNodes>(this,
+                                                       retired->replacedIn);
+        retired->moveUnheld(pinned, *free);
+        if (free->size() != 0) {
+            unheld.push_back(std::move(free));
+        }
+        if (retired->size() == 0) {
+            unheld.emplace_back(retired);
+        } else {
+            held[kept++] = retired;
+        }
+    }
+    held.resize(kept);
+}
+
+void RcuHamt::reclaim(RetiredHamtNodes *retired) const {
+    // Freed once we've let go of the lock.
+    std::unique_ptr<RetiredHamtNodes> unheld;
+
+    std::lock_guard<std::mutex> lock(snapshotMutex);
+    if (pinned.empty()) {
+        unheld.reset(retired);
+        return;
+    }
+
+    unheld = std::make_unique<RetiredHamtNodes>(this, retired->replacedIn);
+    retired->moveUnheld(pinned, *unheld);
+    if (retired->size() == 0) {
+        delete retired;
+    } else {
+        held.push_back(retired);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Snapshots and diffs.
+//
+
+// Call f with every key under entry.
+static void forEachKey(const HamtNodeEntry &entry,
+                       const RcuHamt::KeyCallback &f) {
+    if (entry.isNull()) {
+        return;
+    }
+
+    if (entry.isLeaf()) {
+        f(entry.getLeaf().data());
+        return;
+    }
+
+    auto &node = entry.getChild();
+    for (int i = 0; i < node.numberOfChildren(); ++i) {
+        forEachKey(node.children[i], f);
+    }
+}
+
+// Report the differences under two entries at the same place in two
+// versions of a trie.
+static void diffEntries(const HamtNodeEntry &from, const HamtNodeEntry &to,
+                        const RcuHamt::KeyCallback &onRemoved,
+                        const RcuHamt::KeyCallback &onAdded) {
+    // Everything the two versions share, which is nearly everything when
+    // they're close, is skipped right here.
+    if (from.sharesWith(to)) {
+        return;
+    }
+    if (from.isNull()) {
+        forEachKey(to, onAdded);
+        return;
+    }
+    if (to.isNull()) {
+        forEachKey(from, onRemoved);
+        return;
+    }
+
+    if (!from.isLeaf() && !to.isLeaf()) {
+        auto &fromNode = from.getChild();
+        auto &toNode = to.getChild();
+        const HamtNodeEntry none;
+
+        for (uint64_t hash = 0; hash < TOP_LEVEL_ENTRIES; ++hash) {
+            bool inFrom = fromNode.containsHash(hash);
+            bool inTo = toNode.containsHash(hash);
+            if (!inFrom && !inTo) continue;
+
+            auto &fromChild = inFrom
+                ? fromNode.children[fromNode.numberOfHashesAbove(hash) - 1]
+                : none;
+            auto &toChild = inTo
+                ? toNode.children[toNode.numberOfHashesAbove(hash) - 1]
+                : none;
+            diffEntries(fromChild, toChild, onRemoved, onAdded);
+        }
+        return;
+    }
+
+    // A leaf against a leaf or a node. The same key can be on both sides,
+    // when a leaf was copied and pushed down to make room for another, but
+    // there are only ever a few keys here, so just compare them all.
+    std::vector<std::string_view> fromKeys;
+    std::vector<std::string_view> toKeys;
+    forEachKey(from, [&](std::string_view key) { fromKeys.push_back(key); });
+    forEachKey(to, [&](std::string_view key) { toKeys.push_back(key); });
+    std::sort(fromKeys.begin(), fromKeys.end());
+    std::sort(toKeys.begin(), toKeys.end());
+
+    for (auto key: fromKeys) {
+        if (!std::binary_search(toKeys.begin(), toKeys.end(), key)) {
+            onRemoved(key);
+        }
+    }
+    for (auto key: toKeys) {
+        if (!std::binary_search(fromKeys.begin(), fromKeys.end(), key)) {
+            onAdded(key);
+        }
+    }
+}
+
+void RcuHamt::diff(const Snapshot &from, const Snapshot &to,
+                   const KeyCallback &onRemoved, const KeyCallback &onAdded) {
+    assert(from.hamt == to.hamt);
+
+    for (unsigned i = 0; i < TOP_LEVEL_ENTRIES; ++i) {
+        diffEntries(from.root->table[i], to.root->table[i], onRemoved,
+                    onAdded);
+    }
+}
+
+RcuHamt::Snapshot::Snapshot(const RcuHamt *hamt,
+                            const TopLevelHamtNode *root)
+    : hamt(hamt), root(root) {}
+
+RcuHamt::Snapshot::Snapshot(Snapshot &&other)
+    : hamt(other.hamt), root(other.root) {
+    other.hamt = nullptr;
+    other.root = nullptr;
+}
+
+RcuHamt::Snapshot &RcuHamt::Snapshot::operator=(Snapshot &&other) {
+    if (this != &other) {
+        reset();
+        hamt = other.hamt;
+        root = other.root;
+        other.hamt = nullptr;
+        other.root = nullptr;
+    }
+    return *this;
+}
+
+RcuHamt::Snapshot::~Snapshot() {
+    reset();
+}
+
+void RcuHamt::Snapshot::reset() {
+    if (hamt != nullptr) {
+        hamt->unpin(root->version);
+        hamt = nullptr;
+        root = nullptr;
+    }
+}
+
+bool RcuHamt::Snapshot::find(const std::string &str) const {
+    return root->find(hamt->hasher(str), str);
+}
+
+void RcuHamt::Snapshot::forEach(const KeyCallback &f) const {
+    for (auto &entry: root->table) {
+        forEachKey(entry, f);
+    }
+}
+
+uint64_t RcuHamt::Snapshot::version() const {
+    return root->version;
+}
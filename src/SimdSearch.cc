@@ -0,0 +1,110 @@
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "SimdSearch.hh"
+
+namespace rcu {
+
+//////////////////////////////////////////////////////////////////////////////
+// Kernels.
+//
+
+static bool containsScalar(const std::uint64_t *data, size_t n,
+                           std::uint64_t value) {
+    // No early exit, so that the compiler can still vectorize this with
+    // whatever the baseline target has.
+    bool found = false;
+    for (size_t i = 0; i < n; ++i) {
+        found |= data[i] == value;
+    }
+    return found;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+static bool containsAvx2(const std::uint64_t *data, size_t n,
+                         std::uint64_t value) {
+    auto needle = _mm256_set1_epi64x(value);
+    auto any = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto values = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(data + i));
+        any = _mm256_or_si256(any, _mm256_cmpeq_epi64(values, needle));
+    }
+
+    return !_mm256_testz_si256(any, any)
+        || containsScalar(data + i, n - i, value);
+}
+
+__attribute__((target("avx512f")))
+static bool containsAvx512(const std::uint64_t *data, size_t n,
+                           std::uint64_t value) {
+    auto needle = _mm512_set1_epi64(value);
+    __mmask8 any = 0;
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto values = _mm512_loadu_si512(data + i);
+        any |= _mm512_cmpeq_epi64_mask(values, needle);
+    }
+
+    // Masked loads don't touch the lanes past the end.
+    if (i < n) {
+        __mmask8 tail = (1U << (n - i)) - 1;
+        auto values = _mm512_maskz_loadu_epi64(tail, data + i);
+        any |= _mm512_mask_cmpeq_epi64_mask(tail, values, needle);
+    }
+
+    return any != 0;
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// Dispatch.
+//
+
+using ContainsFunction = bool (*)(const std::uint64_t *, size_t,
+                                  std::uint64_t);
+
+struct SearchKernel {
+    ContainsFunction contains;
+    const char *name;
+};
+
+static SearchKernel chooseKernel(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return { containsAvx512, "avx512" };
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return { containsAvx2, "avx2" };
+    }
+#endif
+    return { containsScalar, "scalar" };
+}
+
+// A function-local static, so that this works even from other translation
+// units' static initializers.
+static const SearchKernel &kernel(void) {
+    static const SearchKernel chosen = chooseKernel();
+    return chosen;
+}
+
+bool containsValue(const std::uint64_t *data, size_t n, std::uint64_t value) {
+    return kernel().contains(data, n, value);
+}
+
+const char *searchKernelName(void) {
+    return kernel().name;
+}
+
+}
@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "Stats.hh"
+
+namespace rcu {
+
+const char *statName(Stat stat) {
+    switch (stat) {
+    case Stat::GRACE_PERIODS:        return "grace_periods";
+    case Stat::SHARED_GRACE_PERIODS: return "shared_grace_periods";
+    case Stat::QSBR_GRACE_PERIODS:   return "qsbr_grace_periods";
+    case Stat::READER_WAITS:         return "reader_waits";
+    case Stat::READER_SPINS:         return "reader_spins";
+    case Stat::READER_YIELDS:        return "reader_yields";
+    case Stat::READER_SLEEPS:        return "reader_sleeps";
+    case Stat::GC_PUBLISHED:         return "gc_published";
+    case Stat::GC_RECLAIMED:         return "gc_reclaimed";
+    case Stat::GC_RECLAIM_PASSES:    return "gc_reclaim_passes";
+    case Stat::LIST_CAS_RETRIES:     return "list_cas_retries";
+    case Stat::LIST_ELIMINATIONS:    return "list_eliminations";
+    }
+    return "unknown";
+}
+
+const char *latencyName(Latency latency) {
+    switch (latency) {
+    case Latency::GRACE_PERIOD:      return "grace_period_ns";
+    case Latency::QSBR_GRACE_PERIOD: return "qsbr_grace_period_ns";
+    case Latency::RECLAIM_DELAY:     return "reclaim_delay_ns";
+    }
+    return "unknown";
+}
+
+#ifdef RCU_STATS
+
+// The blocks of every thread that has counted anything and not yet exited,
+// and the totals of those that have.
+//
+// CAN ONLY BE READ OR MODIFIED WHILE HOLDING statsMutex.
+static std::mutex statsMutex;
+static std::vector<ThreadStats *> liveStats;
+static StatsSnapshot exitedStats;
+
+static void addTo(StatsSnapshot &snapshot, const ThreadStats &stats) {
+    for (size_t i = 0; i < STAT_COUNT; ++i) {
+        snapshot.counters[i] +=
+            stats.counters[i].load(std::memory_order_relaxed);
+    }
+
+    for (size_t i = 0; i < LATENCY_COUNT; ++i) {
+        auto &from = stats.latencies[i];
+        auto &to = snapshot.latencies[i];
+        for (size_t b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+            auto n = from.buckets[b].load(std::memory_order_relaxed);
+            if (n != 0) to.addBucket(b, n);
+        }
+        to.addTotals(from.sum.load(std::memory_order_relaxed),
+                     from.highest.load(std::memory_order_relaxed));
+    }
+}
+
+// Hands the current thread's block back as the thread exits.
+struct ThreadStatsOwner {
+    ~ThreadStatsOwner() {
+        if (threadStats == nullptr) return;
+
+        std::unique_lock lock(statsMutex);
+        addTo(exitedStats, *threadStats);
+        liveStats.erase(std::find(liveStats.begin(), liveStats.end(),
+                                  threadStats));
+        delete threadStats;
+        threadStats = nullptr;
+    }
+};
+
+static thread_local ThreadStatsOwner threadStatsOwner;
+
+ThreadStats *createThreadStats(void) {
+    // Touch the owner, so that its destructor runs when we exit.
+    (void)threadStatsOwner;
+
+    auto stats = new ThreadStats();
+    {
+        std::unique_lock lock(statsMutex);
+        liveStats.push_back(stats);
+    }
+    threadStats = stats;
+    return stats;
+}
+
+StatsSnapshot statsSnapshot(void) {
+    std::unique_lock lock(statsMutex);
+
+    StatsSnapshot result = exitedStats;
+    for (auto stats: liveStats) {
+        addTo(result, *stats);
+    }
+    return result;
+}
+
+#else
+
+StatsSnapshot statsSnapshot(void) {
+    return StatsSnapshot();
+}
+
+#endif
+
+}
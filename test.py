@@ -21,7 +21,10 @@ def wrapCommand(cmd):
 def runWithFlags(flags):
     # -DCMAKE_EXPORT... tells cmake to generate a clang compilation database for
     # tooling.
+    # -DRCU_POISON... poisons freed nodes, so the stress test catches readers
+    # that use them after their grace period.
     wrapCommand(["cmake", "-DCMAKE_EXPORT_COMPILE_COMMANDS=ON",
+                          "-DRCU_POISON=ON",
                           f"-DCMAKE_CXX_FLAGS={','.join(flags)}",
                           ".."])
     # Put the clang DB at the project directory so tools can find it.
@@ -29,6 +32,7 @@ def runWithFlags(flags):
 
     wrapCommand(["make"])
     wrapCommand(["./test"])
+    wrapCommand(["./stress"])
     wrapCommand(["valgrind", "./test"])
 
 def main():
@@ -0,0 +1,650 @@
+// Stress tests for the RCU guarantees and the lock-free structures, and how
+// they scale.
+//
+// Usage: stress [--max-threads N] [--duration-ms D] [--stall-ms S] [--pin]
+//
+// Runs five stress tests, each once for every thread count from 1 through
+// --max-threads (by default, one per CPU, but at least 2) for --duration-ms,
+// and prints the results as a single JSON object on stdout, along with
+// "mechanism", the RCU mechanism in use (see rcu::Mechanism), and
+// "poisoned", whether freed nodes are poisoned (see Poison.hh):
+//
+//  - "grace_period": that many readers check, in every critical section,
+//    that the objects they read haven't outlived a grace period, while one
+//    writer retires objects with synchronize and synchronizeExpedited and
+//    another through a GarbageCollector. Readers now and then stall in a
+//    critical section for --stall-ms, which synchronize must wait out.
+//  - "list": RcuList throughput, in ops per microsecond, with that many
+//    threads doing 90% searches and the rest evenly split pushes and pops.
+//    Afterwards, whatever wasn't popped must still be there.
+//  - "queue": RcuQueue throughput with that many threads alternately
+//    enqueuing and dequeuing, some of each in batches. Every value must come
+//    out exactly once, in the order its thread enqueued it.
+//  - "skip_list": RcuSkipList throughput with that many threads doing
+//    lookups and range scans over keys that are always there, while
+//    inserting and erasing keys of their own in between them. Scans must
+//    see keys strictly in order, and never miss a stable one.
+//  - "hash_map": RcuHashMap throughput with that many threads each
+//    inserting a burst of keys of its own and then erasing them all, so
+//    that the table keeps growing and shrinking, in between lookups that
+//    must always find the keys that are always there. Also reports the
+//    fewest and most buckets seen.
+//
+// Exits with status 1 and a message on stderr as soon as a check fails.
+//
+// Configure with -DRCU_POISON=ON so that nodes used after being freed are
+// caught right away, rather than only by a valgrind run (see test.py), and
+// with CMAKE_BUILD_TYPE=Release for meaningful throughput.
+//
+// --pin pins each thread to its own CPU.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "NodePool.hh"
+#include "RCU.hh"
+#include "RcuHashMap.hh"
+#include "RcuList.hh"
+#include "RcuQueue.hh"
+#include "RcuSkipList.hh"
+
+using Clock = std::chrono::steady_clock;
+
+//////////////////////////////////////////////////////////////////////////////
+// Constants.
+//
+
+// How many grace periods the writer waits for between retiring an object and
+// freeing it. Readers only ever legitimately see it one grace period old;
+// the rest are there to catch late ones before it's freed.
+const unsigned RETIRED_AGE = 4;
+
+// Each reader stalls for --stall-ms at most once per this many times as
+// long, so that grace periods also get to run without a stalled reader.
+const unsigned STALL_SPACING = 10;
+
+// What every live TortureNode holds in magic.
+const std::uint64_t TORTURE_MAGIC = 0x7A11AB1E5CA1AB1E;
+
+//////////////////////////////////////////////////////////////////////////////
+// Helpers.
+//
+
+struct Options {
+    unsigned maxThreads = std::max(2u, std::thread::hardware_concurrency());
+    unsigned durationMs = 500;
+    unsigned stallMs = 10;
+    bool pin = false;
+};
+
+void usage(const char *argv0) {
+    std::cerr << "Usage: " << argv0 << " [--max-threads N] [--duration-ms D]"
+              << " [--stall-ms S] [--pin]\n";
+    exit(1);
+}
+
+Options parseOptions(int argc, char **argv) {
+    Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string(argv[i]);
+
+        if (arg == "--pin") {
+            options.pin = true;
+            continue;
+        }
+
+        if (i + 1 == argc) usage(argv[0]);
+        auto value = std::strtoull(argv[++i], nullptr, 10);
+
+        if (arg == "--max-threads") {
+            options.maxThreads = value;
+        } else if (arg == "--duration-ms") {
+            options.durationMs = value;
+        } else if (arg == "--stall-ms") {
+            options.stallMs = value;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (options.maxThreads == 0) usage(argv[0]);
+
+    return options;
+}
+
+// Other threads are still running, so skip static destructors, which would
+// pull RCU's globals out from under them.
+void fail(const char *what) {
+    std::cerr << "Stress test failed: " << what << ".\n";
+    std::_Exit(1);
+}
+
+void pinToCpu(unsigned idx) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(idx % std::thread::hardware_concurrency(), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+double nsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start)
+        .count();
+}
+
+// Start threads, let them run for the test's duration, and join them.
+//
+// Each thread spins until go, and should stop once it sees done.
+template<typename F>
+void runFor(const Options &options, unsigned n, F f) {
+    std::atomic<bool> go(false);
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+
+    for (unsigned i = 0; i < n; ++i) {
+        threads.emplace_back([&, i] {
+            if (options.pin) pinToCpu(i);
+            rcu::registerCurrentThread();
+            while (!go.load(std::memory_order_relaxed)) {}
+            f(i, done);
+            rcu::unregisterCurrentThread();
+        });
+    }
+
+    go.store(true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(options.durationMs));
+    done.store(true);
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Grace periods.
+//
+
+struct TortureNode {
+    std::atomic<TortureNode *> gcNext;
+    // 0 while current, and then how many grace periods, counting the one in
+    // progress, have started since it was retired.
+    std::atomic<unsigned> age;
+    std::uint64_t magic;
+
+    std::atomic<TortureNode *> &getGcNext(void) {
+        return gcNext;
+    }
+};
+
+std::atomic<std::uint64_t> stallReports(0);
+
+void countStallReport(const rcu::ReaderStall &) {
+    stallReports.fetch_add(1, std::memory_order_relaxed);
+}
+
+void stressGracePeriods(const Options &options, unsigned readers) {
+    rcu::NodePool<TortureNode> pool;
+    rcu::GarbageCollector<TortureNode,
+                          rcu::NodePool<TortureNode>::Deleter> gc(
+            rcu::GcPolicy(), { &pool });
+
+    std::atomic<TortureNode *> current(
+            pool.create(nullptr, 0u, TORTURE_MAGIC));
+    std::atomic<TortureNode *> collected(
+            pool.create(nullptr, 0u, TORTURE_MAGIC));
+
+    std::atomic<std::uint64_t> sections(0);
+    std::atomic<std::uint64_t> stalls(0);
+    // How many synchronize calls the synchronous writer has returned from.
+    std::atomic<std::uint64_t> gracePeriods(0);
+
+    // Stalls should outlast the detector's timeout, so it gets exercised
+    // too.
+    stallReports.store(0);
+    if (options.stallMs != 0) {
+        rcu::setStallDetector(
+                std::chrono::milliseconds(options.stallMs) / 2,
+                countStallReport);
+    }
+
+    runFor(options, readers + 2, [&](unsigned idx,
+                                     std::atomic<bool> &done) {
+        if (idx == readers) {
+            // The synchronous writer: retire the current object, and mark
+            // each grace period it lives through before freeing it.
+            bool expedited = false;
+            while (!done.load(std::memory_order_relaxed)) {
+                auto old = current.exchange(
+                        pool.create(nullptr, 0u, TORTURE_MAGIC),
+                        std::memory_order_acq_rel);
+                for (unsigned age = 1; age <= RETIRED_AGE; ++age) {
+                    old->age.store(age, std::memory_order_release);
+                    if (expedited) {
+                        rcu::synchronizeExpedited();
+                    } else {
+                        rcu::synchronize();
+                    }
+                    gracePeriods.fetch_add(1);
+                }
+                pool.destroy(old);
+                expedited = !expedited;
+            }
+            return;
+        }
+
+        if (idx == readers + 1) {
+            // The asynchronous writer, which leaves freeing to the GC.
+            while (!done.load(std::memory_order_relaxed)) {
+                auto old = collected.exchange(
+                        pool.create(nullptr, 0u, TORTURE_MAGIC),
+                        std::memory_order_acq_rel);
+                gc.discard(old);
+                std::this_thread::yield();
+            }
+            return;
+        }
+
+        std::uint64_t count = 0;
+        std::uint64_t stalled = 0;
+        auto nextStall = Clock::now();
+        auto stallFor = std::chrono::milliseconds(options.stallMs);
+
+        while (!done.load(std::memory_order_relaxed)) {
+            rcu::ReadGuard guard;
+            rcu::Protected<TortureNode *> node(current);
+            rcu::Protected<TortureNode *> other(collected);
+
+            // Only reading the clock now and then keeps critical sections
+            // short the rest of the time.
+            bool stall = options.stallMs != 0 && count % 1024 == 0
+                      && Clock::now() >= nextStall;
+            if (stall) {
+                // Only a synchronize call already in progress when our
+                // critical section started may return before it ends. The
+                // writer makes one call at a time, so at most one does.
+                auto before = gracePeriods.load();
+                std::this_thread::sleep_for(stallFor);
+                if (gracePeriods.load() - before > 1) {
+                    fail("synchronize didn't wait for a stalled reader");
+                }
+                stalled++;
+                nextStall = Clock::now() + stallFor * STALL_SPACING;
+            }
+
+            auto age = node->age.load(std::memory_order_acquire);
+            if (node->magic != TORTURE_MAGIC
+             || other->magic != TORTURE_MAGIC) {
+                fail("a reader saw a freed object");
+            }
+            if (age > 1) {
+                fail("a reader saw an object a full grace period after "
+                     "it was retired");
+            }
+            count++;
+        }
+
+        sections.fetch_add(count);
+        stalls.fetch_add(stalled);
+    });
+
+    if (options.stallMs != 0) {
+        rcu::setStallDetector(rcu::DEFAULT_STALL_TIMEOUT);
+    }
+
+    gc.join();
+    pool.destroy(current.load());
+    pool.destroy(collected.load());
+
+    std::cout << "{\"readers\": " << readers
+              << ", \"sections\": " << sections.load()
+              << ", \"grace_periods\": " << gracePeriods.load()
+              << ", \"stalls\": " << stalls.load()
+              << ", \"stall_reports\": " << stallReports.load() << "}";
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Scaling.
+//
+
+void stressList(const Options &options, unsigned threads) {
+    const std::uint64_t listLength = 1000;
+
+    RcuList list;
+    for (std::uint64_t i = 0; i < listLength; ++i) {
+        list.push(i);
+    }
+
+    std::atomic<std::uint64_t> ops(0);
+    std::atomic<std::uint64_t> pushes(0);
+    std::atomic<std::uint64_t> pops(0);
+
+    auto start = Clock::now();
+    runFor(options, threads, [&](unsigned idx, std::atomic<bool> &done) {
+        std::minstd_rand rng(idx);
+        std::uint64_t count = 0;
+        std::uint64_t pushed = 0;
+        std::uint64_t popped = 0;
+
+        while (!done.load(std::memory_order_relaxed)) {
+            auto roll = rng() % 100;
+            if (roll < 90) {
+                list.search(rng() % listLength);
+            } else if (roll % 2 == 0) {
+                // RcuList expects values to be unique.
+                list.push(((std::uint64_t)idx + 1) << 40 | count);
+                pushed++;
+            } else {
+                popped += list.pop() != 0xDEAD;
+            }
+            count++;
+        }
+
+        ops.fetch_add(count);
+        pushes.fetch_add(pushed);
+        pops.fetch_add(popped);
+    });
+    auto ns = nsSince(start);
+
+    std::uint64_t left = 0;
+    while (list.pop() != 0xDEAD) left++;
+    if (left != listLength + pushes.load() - pops.load()) {
+        fail("RcuList lost or duplicated values");
+    }
+    list.joinGC();
+
+    std::cout << "{\"threads\": " << threads
+              << ", \"ops_per_us\": " << ops.load() * 1000.0 / ns << "}";
+}
+
+void stressQueue(const Options &options, unsigned threads) {
+    const size_t batch = 8;
+
+    RcuQueue<std::uint64_t> queue;
+
+    std::atomic<std::uint64_t> ops(0);
+    std::atomic<std::uint64_t> enqueues(0);
+    std::atomic<std::uint64_t> dequeues(0);
+
+    auto start = Clock::now();
+    runFor(options, threads, [&](unsigned idx, std::atomic<bool> &done) {
+        // Values are the enqueuing thread's index above a sequence number
+        // starting from 1, so last[i] == 0 means nothing from thread i yet.
+        std::vector<std::uint64_t> last(threads, 0);
+        std::uint64_t values[batch];
+        std::uint64_t seq = 1;
+        std::uint64_t count = 0;
+        std::uint64_t enqueued = 0;
+        std::uint64_t dequeued = 0;
+
+        auto check = [&](std::uint64_t value) {
+            auto from = value >> 40;
+            if (from >= threads || value <= last[from]) {
+                fail("RcuQueue handed out a value out of order");
+            }
+            last[from] = value;
+        };
+
+        while (!done.load(std::memory_order_relaxed)) {
+            if (count % 16 == 0) {
+                for (size_t i = 0; i < batch; ++i) {
+                    values[i] = (std::uint64_t)idx << 40 | seq++;
+                }
+                queue.enqueueBatch(values, values + batch);
+                enqueued += batch;
+
+                auto got = queue.dequeueBatch(batch, values);
+                for (size_t i = 0; i < got; ++i) {
+                    check(values[i]);
+                }
+                dequeued += got;
+            } else {
+                queue.enqueue((std::uint64_t)idx << 40 | seq++);
+                enqueued++;
+
+                if (queue.dequeue(values[0])) {
+                    check(values[0]);
+                    dequeued++;
+                }
+            }
+            count += 2;
+        }
+
+        ops.fetch_add(count);
+        enqueues.fetch_add(enqueued);
+        dequeues.fetch_add(dequeued);
+    });
+    auto ns = nsSince(start);
+
+    std::uint64_t left = 0;
+    std::uint64_t value;
+    while (queue.dequeue(value)) left++;
+    if (left != enqueues.load() - dequeues.load()) {
+        fail("RcuQueue lost or duplicated values");
+    }
+    queue.joinGC();
+
+    std::cout << "{\"threads\": " << threads
+              << ", \"ops_per_us\": " << ops.load() * 1000.0 / ns << "}";
+}
+
+void stressSkipList(const Options &options, unsigned threads) {
+    // Key 2k is always there for every k below stableKeys. Thread idx owns
+    // the odd keys 2(j * threads + idx) + 1, for j below ownKeys, which puts
+    // them in between. Every key's value is twice the key.
+    const std::uint64_t stableKeys = 1000;
+    const std::uint64_t window = 64;
+    const std::uint64_t ownKeys = std::max<std::uint64_t>(
+            1, stableKeys / threads);
+
+    RcuSkipList<std::uint64_t, std::uint64_t> list;
+    for (std::uint64_t k = 0; k < stableKeys; ++k) {
+        list.insert(2 * k, 4 * k);
+    }
+
+    std::atomic<std::uint64_t> ops(0);
+    std::atomic<std::uint64_t> present(0);
+
+    auto start = Clock::now();
+    runFor(options, threads, [&](unsigned idx, std::atomic<bool> &done) {
+        std::minstd_rand rng(idx);
+        std::vector<bool> mine(ownKeys, false);
+        std::uint64_t count = 0;
+
+        auto ownKey = [&](std::uint64_t j) {
+            return 2 * (j * threads + idx) + 1;
+        };
+
+        while (!done.load(std::memory_order_relaxed)) {
+            auto roll = rng() % 100;
+            if (roll < 60) {
+                auto key = 2 * (rng() % stableKeys);
+                std::uint64_t value;
+                if (!list.find(key, value) || value != 2 * key) {
+                    fail("RcuSkipList lost a stable key");
+                }
+                auto j = rng() % ownKeys;
+                if (list.contains(ownKey(j)) != mine[j]) {
+                    fail("RcuSkipList disagreed with its only writer");
+                }
+            } else if (roll < 80) {
+                auto lo = 2 * (rng() % stableKeys);
+                std::uint64_t stable = 0;
+                std::uint64_t last = 0;
+                bool first = true;
+                list.forEachInRange(lo, lo + 2 * window,
+                        [&](std::uint64_t key, std::uint64_t value) {
+                    if ((!first && key <= last) || value != 2 * key) {
+                        fail("RcuSkipList scanned keys out of order");
+                    }
+                    first = false;
+                    last = key;
+                    stable += key % 2 == 0;
+                });
+                if (stable != std::min(window, stableKeys - lo / 2)) {
+                    fail("RcuSkipList scan missed a stable key");
+                }
+            } else {
+                auto j = rng() % ownKeys;
+                bool ok = mine[j] ? list.erase(ownKey(j))
+                                  : list.insert(ownKey(j), 2 * ownKey(j));
+                if (!ok) {
+                    fail("RcuSkipList disagreed with its only writer");
+                }
+                mine[j] = !mine[j];
+            }
+            count++;
+        }
+
+        ops.fetch_add(count);
+        present.fetch_add(std::count(mine.begin(), mine.end(), true));
+    });
+    auto ns = nsSince(start);
+
+    std::uint64_t left = 0;
+    list.forEachInRange(0, UINT64_MAX, [&](std::uint64_t, std::uint64_t) {
+        left++;
+    });
+    if (left != stableKeys + present.load()) {
+        fail("RcuSkipList lost or duplicated keys");
+    }
+    list.joinGC();
+
+    std::cout << "{\"threads\": " << threads
+              << ", \"ops_per_us\": " << ops.load() * 1000.0 / ns << "}";
+}
+
+void stressHashMap(const Options &options, unsigned threads) {
+    // Keys below stableKeys are always there. Thread idx owns the keys with
+    // idx + 1 above bit 32. Every key's value is twice the key.
+    const std::uint64_t stableKeys = 256;
+    const std::uint64_t burst = 2048;
+
+    RcuHashMap<std::uint64_t, std::uint64_t> map;
+    for (std::uint64_t k = 0; k < stableKeys; ++k) {
+        map.insert(k, 2 * k);
+    }
+
+    std::atomic<std::uint64_t> ops(0);
+    std::atomic<std::uint64_t> present(0);
+    std::atomic<size_t> minBuckets(SIZE_MAX);
+    std::atomic<size_t> maxBuckets(0);
+
+    auto start = Clock::now();
+    runFor(options, threads, [&](unsigned idx, std::atomic<bool> &done) {
+        std::minstd_rand rng(idx);
+        // Own keys below filled are in the map.
+        std::uint64_t filled = 0;
+        bool filling = true;
+        std::uint64_t count = 0;
+        size_t fewest = SIZE_MAX;
+        size_t most = 0;
+
+        auto ownKey = [&](std::uint64_t j) {
+            return ((std::uint64_t)idx + 1) << 32 | j;
+        };
+
+        while (!done.load(std::memory_order_relaxed)) {
+            if (rng() % 100 < 80) {
+                auto key = rng() % stableKeys;
+                std::uint64_t value;
+                if (!map.find(key, value) || value != 2 * key) {
+                    fail("RcuHashMap lost a stable key during a resize");
+                }
+                auto j = rng() % burst;
+                if (map.contains(ownKey(j)) != (j < filled)) {
+                    fail("RcuHashMap disagreed with its only writer");
+                }
+            } else if (filling) {
+                if (!map.insert(ownKey(filled), 2 * ownKey(filled))) {
+                    fail("RcuHashMap disagreed with its only writer");
+                }
+                filling = ++filled != burst;
+            } else {
+                if (!map.erase(ownKey(--filled))) {
+                    fail("RcuHashMap disagreed with its only writer");
+                }
+                filling = filled == 0;
+            }
+
+            if (count % 256 == 0) {
+                auto buckets = map.bucketCount();
+                fewest = std::min(fewest, buckets);
+                most = std::max(most, buckets);
+            }
+            count++;
+        }
+
+        ops.fetch_add(count);
+        present.fetch_add(filled);
+        auto seen = minBuckets.load();
+        while (fewest < seen && !minBuckets.compare_exchange_weak(seen,
+                                                                  fewest)) {}
+        seen = maxBuckets.load();
+        while (most > seen && !maxBuckets.compare_exchange_weak(seen,
+                                                                most)) {}
+    });
+    auto ns = nsSince(start);
+
+    if (map.size() != stableKeys + present.load()) {
+        fail("RcuHashMap lost or duplicated keys");
+    }
+    for (std::uint64_t k = 0; k < stableKeys; ++k) {
+        if (!map.contains(k)) {
+            fail("RcuHashMap lost a stable key");
+        }
+    }
+    map.joinGC();
+
+    std::cout << "{\"threads\": " << threads
+              << ", \"ops_per_us\": " << ops.load() * 1000.0 / ns
+              << ", \"min_buckets\": " << minBuckets.load()
+              << ", \"max_buckets\": " << maxBuckets.load() << "}";
+}
+
+// Print "name": [...], running stress once for each thread count.
+void sweep(const Options &options, const char *name,
+           void (*stress)(const Options &, unsigned)) {
+    std::cout << "\"" << name << "\": [";
+    for (unsigned n = 1; n <= options.maxThreads; ++n) {
+        if (n != 1) std::cout << ", ";
+        stress(options, n);
+    }
+    std::cout << "]";
+}
+
+int main(int argc, char **argv) {
+    auto options = parseOptions(argc, argv);
+
+    rcu::registerCurrentProcess();
+    rcu::registerCurrentThread();
+
+    std::cout << "{\"mechanism\": \""
+              << rcu::mechanismName(rcu::activeMechanism())
+              << "\", \"poisoned\": "
+              << (rcu::POISON_ENABLED ? "true" : "false") << ", ";
+    sweep(options, "grace_period", stressGracePeriods);
+    std::cout << ", ";
+    sweep(options, "list", stressList);
+    std::cout << ", ";
+    sweep(options, "queue", stressQueue);
+    std::cout << ", ";
+    sweep(options, "skip_list", stressSkipList);
+    std::cout << ", ";
+    sweep(options, "hash_map", stressHashMap);
+    std::cout << "}\n";
+
+    rcu::unregisterCurrentThread();
+
+    return 0;
+}
@@ -1,11 +1,31 @@
+#include <algorithm>
 #include <atomic>
+#include <cstddef>
 #include <iostream>
 #include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
 #include <thread>
 #include <vector>
 
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Cell.hh"
+#include "HAMT.hh"
 #include "RCU.hh"
+#include "RcuHamt.hh"
+#include "RcuHashMap.hh"
 #include "RcuList.hh"
+#include "RcuQueue.hh"
+#include "RcuSkipList.hh"
+#include "RcuUnrolledList.hh"
+#include "SimdSearch.hh"
+#include "Stats.hh"
 
 void die() {
     std::cerr << "Test failed!\n";
@@ -23,7 +43,114 @@ void threadFunction() {
     rcu::unregisterCurrentThread();
 }
 
-void modify(std::atomic<bool> &go, RcuList &list,
+void synchronizeMany(bool expedited) {
+    rcu::registerCurrentThread();
+    for (int i = 0; i < 1000; ++i) {
+        if (expedited) {
+            rcu::synchronizeExpedited();
+        } else {
+            rcu::synchronize();
+        }
+    }
+    rcu::unregisterCurrentThread();
+}
+
+struct Counted {
+    rcu::CallbackHead head;
+    std::atomic<std::uint64_t> *counter;
+
+    static void reclaim(rcu::CallbackHead *head) {
+        auto counted = reinterpret_cast<Counted *>(
+                reinterpret_cast<char *>(head) - offsetof(Counted, head));
+        counted->counter->fetch_add(1, std::memory_order_relaxed);
+        delete counted;
+    }
+};
+
+void callMany(std::atomic<std::uint64_t> &counter) {
+    rcu::registerCurrentThread();
+    for (int i = 0; i < 1000; ++i) {
+        rcu::call(&(new Counted { {}, &counter })->head, Counted::reclaim);
+    }
+    rcu::unregisterCurrentThread();
+}
+
+struct Discarded {
+    std::atomic<Discarded *> gcNext;
+
+    std::atomic<Discarded *> &getGcNext(void) {
+        return gcNext;
+    }
+};
+
+// Discard n objects, returning what the last discard did.
+template<typename GC>
+bool discardMany(GC &gc, size_t n) {
+    bool result = true;
+    for (size_t i = 0; i < n; ++i) {
+        result = gc.discard(new Discarded { nullptr });
+    }
+    return result;
+}
+
+// Objects that say which NUMA node they belong to, for sharded GCs.
+struct OnNode {
+    std::atomic<OnNode *> gcNext;
+    unsigned node;
+
+    std::atomic<OnNode *> &getGcNext(void) {
+        return gcNext;
+    }
+};
+
+// Records which threads freed each node's objects.
+struct NodeDeleter {
+    std::mutex *mutex;
+    std::vector<std::set<std::thread::id>> *freedBy;
+
+    unsigned nodeOf(const OnNode *t) const {
+        return t->node;
+    }
+
+    void operator()(OnNode *t) const {
+        {
+            std::unique_lock lock(*mutex);
+            (*freedBy)[t->node].insert(std::this_thread::get_id());
+        }
+        delete t;
+    }
+};
+
+std::atomic<int> liveConfigs(0);
+
+// A configuration a Cell can be caught halfway through updating.
+struct Config {
+    std::uint64_t version;
+    std::uint64_t doubled;
+
+    explicit Config(std::uint64_t version)
+        : version(version), doubled(2 * version) {
+        liveConfigs.fetch_add(1);
+    }
+
+    Config(const Config &other)
+        : version(other.version), doubled(other.doubled) {
+        liveConfigs.fetch_add(1);
+    }
+
+    ~Config() {
+        liveConfigs.fetch_sub(1);
+    }
+};
+
+std::atomic<unsigned> stallReports(0);
+
+void countStall(const rcu::ReaderStall &) {
+    stallReports.fetch_add(1);
+}
+
+template<typename List>
+void modify(std::atomic<bool> &go, List &list,
             std::uint64_t lower, std::uint64_t upper) {
     while (!go.load(std::memory_order_relaxed) ) {}
 
@@ -40,10 +167,51 @@ void modify(std::atomic<bool> &go, RcuList &list,
     rcu::unregisterCurrentThread();
 }
 
+// Push [lower, upper) and pop as many values again, batch at a time (or one
+// at a time, with push and pop, if batch is 1), recording what was popped in
+// popped.
+void modifyBatch(std::atomic<bool> &go, RcuList &list,
+                 std::uint64_t lower, std::uint64_t upper, size_t batch,
+                 std::vector<std::uint64_t> &popped) {
+    while (!go.load(std::memory_order_relaxed) ) {}
+
+    rcu::registerCurrentThread();
+
+    std::vector<std::uint64_t> values;
+    for (std::uint64_t i = lower; i < upper; i += batch) {
+        if (batch == 1) {
+            list.push(i);
+            continue;
+        }
+
+        values.clear();
+        for (std::uint64_t j = i; j < std::min(i + batch, upper); ++j) {
+            values.push_back(j);
+        }
+        list.pushBatch(values.begin(), values.end());
+    }
+
+    std::vector<std::uint64_t> out(batch);
+    while (popped.size() < upper - lower) {
+        if (batch == 1) {
+            auto value = list.pop();
+            if (value != 0xDEAD) popped.push_back(value);
+            continue;
+        }
+
+        auto n = std::min<size_t>(batch, upper - lower - popped.size());
+        auto got = list.popBatch(n, out.data());
+        popped.insert(popped.end(), out.begin(), out.begin() + got);
+    }
+
+    rcu::unregisterCurrentThread();
+}
+
 const std::uint64_t lower = 10000;
 const std::uint64_t upper = 20000;
 
-void search(std::atomic<bool> &go, RcuList &list) {
+template<typename List>
+void search(std::atomic<bool> &go, List &list) {
     while (!go.load(std::memory_order_relaxed) ) {}
 
     rcu::registerCurrentThread();
@@ -59,22 +227,51 @@ void search(std::atomic<bool> &go, RcuList &list) {
     rcu::unregisterCurrentThread();
 }
 
-int main(void) {
-    require(rcu::registerCurrentProcess());
+void hamtModify(std::atomic<bool> &go, RcuHamt &hamt,
+                std::uint64_t lower, std::uint64_t upper) {
+    while (!go.load(std::memory_order_relaxed) ) {}
+
     rcu::registerCurrentThread();
 
-    std::vector<std::thread> threads;
+    for (std::uint64_t i = lower; i < upper; ++i) {
+        hamt.insert(std::to_string(i));
+    }
 
-    for (int i = 0; i < 8; ++i) {
-        threads.emplace_back(threadFunction);
+    for (std::uint64_t i = lower; i < upper; ++i) {
+        require(hamt.erase(std::to_string(i)));
     }
 
-    for (auto &thread: threads) {
-        thread.join();
+    rcu::unregisterCurrentThread();
+}
+
+void hamtSearch(std::atomic<bool> &go, const RcuHamt &hamt) {
+    while (!go.load(std::memory_order_relaxed) ) {}
+
+    rcu::registerCurrentThread();
+
+    for (int pass = 0; pass < 10; ++pass) {
+        for (std::uint64_t i = upper; i < upper + 10000; ++i) {
+            require(hamt.find(std::to_string(i)));
+        }
     }
 
-    RcuList list;
+    std::vector<std::string> keys;
+    for (std::uint64_t i = upper; i < upper + 10000; ++i) {
+        keys.push_back(std::to_string(i));
+    }
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    hamt.findBatch(keys.data(), keys.size(), found.get());
+    for (std::uint64_t i = 0; i < keys.size(); ++i) {
+        require(found[i]);
+    }
 
+    rcu::unregisterCurrentThread();
+}
+
+// Basic checks, then a multithreaded test, for anything with RcuList's
+// interface.
+template<typename List>
+void testList(List &list) {
     list.push(0);
     list.push(1);
     list.push(2);
@@ -104,15 +301,15 @@ int main(void) {
     }
 
     std::atomic<bool> go(false);
-    threads = std::vector<std::thread>();
+    std::vector<std::thread> threads;
 
-    threads.emplace_back(modify, std::ref(go), std::ref(list),
+    threads.emplace_back(modify<List>, std::ref(go), std::ref(list),
                          0, lower);
-    threads.emplace_back(modify, std::ref(go), std::ref(list),
+    threads.emplace_back(modify<List>, std::ref(go), std::ref(list),
                          lower, upper);
 
     for (int i = 0; i < 8; ++i) {
-        threads.emplace_back(search, std::ref(go), std::ref(list));
+        threads.emplace_back(search<List>, std::ref(go), std::ref(list));
     }
 
     // GO!
@@ -123,6 +320,1097 @@ int main(void) {
         require(list.search(i));
     }
 
+    // Including in batches, mixed in with values that aren't.
+    std::vector<std::uint64_t> values;
+    for (uint64_t i = upper - 16; i < upper + 10016; i += 127) {
+        values.push_back(i);
+    }
+    std::unique_ptr<bool[]> found(new bool[values.size()]);
+    list.searchMany(values.data(), values.size(), found.get());
+    for (size_t i = 0; i < values.size(); ++i) {
+        require(found[i] == (values[i] >= upper && values[i] < upper + 10000));
+    }
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+}
+
+using SkipList = RcuSkipList<std::uint64_t, std::uint64_t>;
+
+// Insert and erase [lower, upper) a few times over, racing with other
+// threads doing the same range. Counts how many erases succeed.
+void skipListModify(std::atomic<bool> &go, SkipList &list,
+                    std::uint64_t lower, std::uint64_t upper,
+                    std::atomic<std::uint64_t> &inserted,
+                    std::atomic<std::uint64_t> &erased) {
+    while (!go.load(std::memory_order_relaxed) ) {}
+
+    rcu::registerCurrentThread();
+
+    for (int pass = 0; pass < 4; ++pass) {
+        for (std::uint64_t i = lower; i < upper; ++i) {
+            inserted += list.insert(i, i * 2);
+        }
+        for (std::uint64_t i = lower; i < upper; ++i) {
+            erased += list.erase(i);
+        }
+    }
+
+    rcu::unregisterCurrentThread();
+}
+
+void skipListSearch(std::atomic<bool> &go, const SkipList &list) {
+    while (!go.load(std::memory_order_relaxed) ) {}
+
+    rcu::registerCurrentThread();
+
+    for (int pass = 0; pass < 10; ++pass) {
+        for (std::uint64_t i = upper; i < upper + 10000; i += 7) {
+            std::uint64_t value;
+            require(list.find(i, value) && value == i * 2);
+        }
+
+        // Range scans are strictly ordered, so never see a key twice, and
+        // never miss the stable keys.
+        std::uint64_t expected = upper;
+        std::uint64_t last = 0;
+        bool first = true;
+        list.forEachInRange(lower, upper + 10000,
+                            [&](std::uint64_t key, std::uint64_t value) {
+            require((first || key > last) && value == key * 2);
+            first = false;
+            last = key;
+            if (key >= upper) {
+                require(key == expected++);
+            }
+        });
+        require(expected == upper + 10000);
+    }
+
+    rcu::unregisterCurrentThread();
+}
+
+void claimRcuSignal(int) {}
+
+void claimRcuSigaction(int, siginfo_t *, void *) {}
+
+// How passesWith's child claims RCU_SIGNAL before registering, if at all.
+enum class SignalClaim {
+    NONE,
+    // With signal.
+    HANDLER,
+    // With sigaction and SA_SIGINFO.
+    SIGACTION,
+};
+
+// Run a smaller version of the list test, and some callbacks, in a child
+// process registered with preferred, since each process registers once.
+// Checks that it gets expected, and returns whether the test passed.
+//
+// Must be called before this process starts any threads.
+bool passesWith(rcu::Mechanism preferred, rcu::Mechanism expected,
+                SignalClaim claim = SignalClaim::NONE) {
+    auto pid = fork();
+    if (pid != 0) {
+        int status;
+        require(waitpid(pid, &status, 0) == pid);
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    if (claim == SignalClaim::HANDLER) {
+        signal(RCU_SIGNAL, claimRcuSignal);
+    } else if (claim == SignalClaim::SIGACTION) {
+        struct sigaction action = {};
+        action.sa_sigaction = claimRcuSigaction;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        require(sigaction(RCU_SIGNAL, &action, nullptr) == 0);
+    }
+    require(rcu::registerCurrentProcess(preferred));
+    require(rcu::activeMechanism() == expected);
+    rcu::registerCurrentThread();
+
+    RcuList list;
+    for (std::uint64_t i = upper; i < upper + 1000; ++i) {
+        list.push(i);
+    }
+
+    std::atomic<bool> go(false);
+    std::atomic<std::uint64_t> counter(0);
+    std::vector<std::thread> threads;
+    threads.emplace_back(modify<RcuList>, std::ref(go), std::ref(list),
+                         0, 2000);
+    threads.emplace_back(modify<RcuList>, std::ref(go), std::ref(list),
+                         2000, 4000);
+    threads.emplace_back(callMany, std::ref(counter));
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&] {
+            while (!go.load(std::memory_order_relaxed) ) {}
+            rcu::registerCurrentThread();
+            for (int pass = 0; pass < 5; ++pass) {
+                for (std::uint64_t v = upper; v < upper + 1000; ++v) {
+                    require(list.search(v));
+                }
+            }
+            rcu::unregisterCurrentThread();
+        });
+    }
+
+    go.store(true);
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    rcu::barrier();
+    require(counter.load() == 1000);
+
+    rcu::unregisterCurrentThread();
+    list.joinGC();
+    exit(0);
+}
+
+using QsbrList = BasicRcuList<rcu::QsbrFlavor>;
+
+// Like modify and search, but online, announcing a quiescent state after
+// every operation.
+void qsbrModify(std::atomic<bool> &go, QsbrList &list,
+                std::uint64_t lower, std::uint64_t upper) {
+    while (!go.load(std::memory_order_relaxed) ) {}
+
+    rcu::registerCurrentThread();
+    rcu::threadOnline();
+
+    for (std::uint64_t i = lower; i < upper; ++i) {
+        list.push(i);
+        rcu::quiescentState();
+    }
+
+    for (std::uint64_t i = lower; i < upper; ++i) {
+        list.pop();
+        rcu::quiescentState();
+    }
+
+    rcu::threadOffline();
+    rcu::unregisterCurrentThread();
+}
+
+void qsbrSearch(std::atomic<bool> &go, QsbrList &list) {
+    while (!go.load(std::memory_order_relaxed) ) {}
+
+    rcu::registerCurrentThread();
+    rcu::threadOnline();
+
+    for (uint64_t i = upper; i < upper + 10000; i += 7) {
+        require(list.search(i));
+        rcu::quiescentState();
+    }
+
+    rcu::threadOffline();
+    rcu::unregisterCurrentThread();
+}
+
+using HashMap = RcuHashMap<std::uint64_t, std::uint64_t>;
+
+// Grow the map to hold [lower, upper) and shrink it back down, a few times.
+void hashMapModify(std::atomic<bool> &go, HashMap &map,
+                   std::uint64_t lower, std::uint64_t upper) {
+    while (!go.load(std::memory_order_relaxed) ) {}
+
+    rcu::registerCurrentThread();
+
+    for (int pass = 0; pass < 4; ++pass) {
+        for (std::uint64_t i = lower; i < upper; ++i) {
+            require(map.insert(i, i * 2));
+        }
+        for (std::uint64_t i = lower; i < upper; ++i) {
+            require(map.erase(i));
+        }
+    }
+
+    rcu::unregisterCurrentThread();
+}
+
+void hashMapSearch(std::atomic<bool> &go, const HashMap &map) {
+    while (!go.load(std::memory_order_relaxed) ) {}
+
+    rcu::registerCurrentThread();
+
+    for (int pass = 0; pass < 20; ++pass) {
+        for (std::uint64_t i = upper; i < upper + 10000; ++i) {
+            std::uint64_t value;
+            require(map.find(i, value) && value == i * 2);
+        }
+    }
+
+    rcu::unregisterCurrentThread();
+}
+
+int main(void) {
+    using namespace std::literals;
+
+    // The fallback mechanisms work, and are only used where they have to be.
+    require(passesWith(rcu::Mechanism::FENCE, rcu::Mechanism::FENCE));
+    require(passesWith(rcu::Mechanism::SIGNAL, rcu::Mechanism::SIGNAL));
+    require(passesWith(rcu::Mechanism::SIGNAL, rcu::Mechanism::FENCE,
+                       SignalClaim::HANDLER));
+    require(passesWith(rcu::Mechanism::SIGNAL, rcu::Mechanism::FENCE,
+                       SignalClaim::SIGACTION));
+
+    require(rcu::registerCurrentProcess());
+    require(rcu::registerCurrentProcess());
+    std::cout << "mechanism: "
+              << rcu::mechanismName(rcu::activeMechanism()) << ".\n";
+    rcu::registerCurrentThread();
+
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back(threadFunction);
+    }
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    // Guards nest like readLock and readUnlock.
+    require(!rcu::inReadSection());
+    {
+        rcu::ReadGuard outer;
+        {
+            rcu::ReadGuard inner;
+            require(rcu::inReadSection());
+        }
+        require(rcu::inReadSection());
+    }
+    require(!rcu::inReadSection());
+
+    // Concurrent synchronize calls share grace periods, lazy and expedited
+    // alike; make sure they all still return.
+    threads = std::vector<std::thread>();
+
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back(synchronizeMany, i % 2 == 0);
+    }
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    // Both kinds wait for readers.
+    for (bool expedited: { false, true }) {
+        std::atomic<int> stage(0);
+        std::atomic<bool> synchronized(false);
+
+        std::thread reader([&] {
+            rcu::registerCurrentThread();
+            rcu::readLock();
+            stage.store(1);
+            while (stage.load() != 2) std::this_thread::yield();
+            rcu::readUnlock();
+            rcu::unregisterCurrentThread();
+        });
+        while (stage.load() != 1) std::this_thread::yield();
+
+        std::thread writer([&] {
+            rcu::registerCurrentThread();
+            if (expedited) {
+                rcu::synchronizeExpedited();
+            } else {
+                rcu::synchronize();
+            }
+            synchronized.store(true);
+            rcu::unregisterCurrentThread();
+        });
+
+        std::this_thread::sleep_for(10ms);
+        require(!synchronized.load());
+        stage.store(2);
+        writer.join();
+        reader.join();
+        require(synchronized.load());
+    }
+
+    // Callbacks must wait for readers, and must all eventually run.
+    std::atomic<std::uint64_t> counter(0);
+
+    rcu::readLock();
+    rcu::call(&(new Counted { {}, &counter })->head, Counted::reclaim);
+    std::this_thread::sleep_for(10ms);
+    require(counter.load() == 0);
+    rcu::readUnlock();
+    rcu::barrier();
+    require(counter.load() == 1);
+
+    threads = std::vector<std::thread>();
+
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back(callMany, std::ref(counter));
+    }
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    rcu::barrier();
+    require(counter.load() == 4001);
+
+    // call wakes the reclaimer itself, so callbacks run without a barrier.
+    {
+        rcu::call(&(new Counted { {}, &counter })->head, Counted::reclaim);
+        auto deadline = std::chrono::steady_clock::now() + 10s;
+        while (counter.load() != 4002) {
+            require(std::chrono::steady_clock::now() < deadline);
+            std::this_thread::sleep_for(1ms);
+        }
+    }
+
+    // A stalled reader gets reported, and holds up reclamation until GCs'
+    // limits push back.
+    {
+        const size_t limit = 2 * rcu::DISCARD_BATCH_SIZE;
+        std::atomic<int> stage(0);
+        unsigned readerIndex;
+        pid_t readerTid;
+
+        rcu::setStallDetector(20ms, countStall);
+
+        std::thread reader([&] {
+            rcu::registerCurrentThread();
+            readerIndex = rcu::currentThreadIndex();
+            readerTid = gettid();
+            rcu::readLock();
+            stage.store(1);
+            while (stage.load() != 2) std::this_thread::yield();
+            rcu::readUnlock();
+            rcu::unregisterCurrentThread();
+        });
+        while (stage.load() != 1) std::this_thread::yield();
+
+        // Reports pressure as soon as it reaches the limit.
+        rcu::GcPolicy policy;
+        policy.pendingObjectsLimit = limit;
+        policy.onLimit = rcu::Backpressure::REPORT;
+        rcu::GarbageCollector<Discarded> reportGc(policy);
+        require(discardMany(reportGc, limit - 1));
+        require(!discardMany(reportGc, 1));
+        require(reportGc.limitHitCount() == 1);
+        require(reportGc.pendingObjects() == limit);
+
+        // Waits, either for the GC thread or for a grace period of its own,
+        // except in a read-side critical section.
+        std::vector<std::unique_ptr<rcu::GarbageCollector<Discarded>>> gcs;
+        std::atomic<unsigned> unblocked(0);
+        threads = std::vector<std::thread>();
+        for (auto onLimit: { rcu::Backpressure::BLOCK,
+                             rcu::Backpressure::SYNCHRONIZE }) {
+            policy.onLimit = onLimit;
+            gcs.emplace_back(new rcu::GarbageCollector<Discarded>(policy));
+
+            rcu::readLock();
+            require(!discardMany(*gcs.back(), limit));
+            rcu::readUnlock();
+
+            // Limits are only checked as a batch is handed over.
+            threads.emplace_back([&, gc = gcs.back().get()] {
+                rcu::registerCurrentThread();
+                discardMany(*gc, rcu::DISCARD_BATCH_SIZE);
+                unblocked.fetch_add(1);
+                rcu::unregisterCurrentThread();
+            });
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + 10s;
+        while (!rcu::stallStats().stalled) {
+            require(std::chrono::steady_clock::now() < deadline);
+            std::this_thread::sleep_for(1ms);
+        }
+        auto stats = rcu::stallStats();
+        require(stats.stalls >= 1 && stallReports.load() >= 1);
+        require(stats.current.index == readerIndex);
+        require(stats.current.tid == readerTid);
+        require(stats.current.waited >= 20ms);
+        require(unblocked.load() == 0);
+
+        stage.store(2);
+        reader.join();
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        require(unblocked.load() == 2);
+
+        reportGc.join();
+        for (auto &gc: gcs) {
+            gc->join();
+        }
+        // Other synchronizers may take a moment to notice.
+        deadline = std::chrono::steady_clock::now() + 10s;
+        while (rcu::stallStats().stalled) {
+            require(std::chrono::steady_clock::now() < deadline);
+            std::this_thread::sleep_for(1ms);
+        }
+
+        rcu::setStallDetector(rcu::DEFAULT_STALL_TIMEOUT);
+    }
+
+    // Sharded GCs free each object on the GC thread of its node's shard.
+    require(rcu::numaNodeCount() >= 1);
+    require(rcu::currentNumaNode() < rcu::numaNodeCount());
+    {
+        std::mutex mutex;
+        std::vector<std::set<std::thread::id>> freedBy(3);
+        rcu::GcPolicy policy;
+        policy.shards = 2;
+        rcu::GarbageCollector<OnNode, NodeDeleter> gc(
+                policy, NodeDeleter { &mutex, &freedBy });
+        require(gc.shardCount() == 2);
+
+        // Runs of objects from one node, and objects from alternating ones.
+        std::thread discarder([&] {
+            rcu::registerCurrentThread();
+            for (unsigned i = 0; i < 3000; ++i) {
+                auto node = i < 1500 ? i / 100 % 3 : i % 3;
+                gc.discard(new OnNode { nullptr, node });
+            }
+            rcu::unregisterCurrentThread();
+        });
+        discarder.join();
+
+        auto deadline = std::chrono::steady_clock::now() + 10s;
+        while (gc.pendingObjects() != 0) {
+            require(std::chrono::steady_clock::now() < deadline);
+            std::this_thread::sleep_for(1ms);
+        }
+        {
+            std::unique_lock lock(mutex);
+            require(freedBy[0].size() == 1 && freedBy[1].size() == 1);
+            require(freedBy[0] != freedBy[1] && freedBy[2] == freedBy[0]);
+        }
+        gc.join();
+
+        policy.shards = 0;
+        rcu::GarbageCollector<Discarded> perNodeGc(policy);
+        require(perNodeGc.shardCount() == rcu::numaNodeCount());
+        perNodeGc.join();
+    }
+
+    // Cell readers always see a whole version, never an older one than
+    // before, and old versions get freed.
+    {
+        rcu::Cell<Config> cell(std::make_unique<Config>(0));
+        std::atomic<bool> done(false);
+
+        threads = std::vector<std::thread>();
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([&] {
+                rcu::registerCurrentThread();
+                std::uint64_t last = 0;
+                while (!done.load()) {
+                    auto snapshot = cell.read();
+                    require(snapshot->doubled == 2 * snapshot->version);
+                    require(snapshot->version >= last);
+                    last = snapshot->version;
+                }
+                rcu::unregisterCurrentThread();
+            });
+        }
+
+        for (std::uint64_t i = 1; i <= 1000; ++i) {
+            if (i % 2 == 1) {
+                cell.update(std::make_unique<Config>(i));
+            } else {
+                cell.updateWith([](Config &config) {
+                    config.version++;
+                    config.doubled = 2 * config.version;
+                });
+            }
+        }
+
+        done.store(true);
+        for (auto &thread: threads) {
+            thread.join();
+        }
+
+        require(cell.read([](const Config &config) {
+            return config.version;
+        }) == 1000);
+        cell.joinGC();
+        require(liveConfigs.load() == 1);
+    }
+    require(liveConfigs.load() == 0);
+
+    // The queue is first in, first out, batches and all, and leaves what's
+    // left for its destructor.
+    {
+        RcuQueue<std::string> queue;
+        std::string out[4];
+        require(queue.empty() && !queue.dequeue(out[0]));
+
+        std::vector<std::string> batch { "b", "c", "d" };
+        queue.enqueue("a");
+        queue.enqueueBatch(batch.begin(), batch.end());
+        queue.enqueueBatch(batch.end(), batch.end());
+        queue.enqueue(std::string(100, 'e'));
+        queue.enqueue(std::string(100, 'f'));
+
+        require(queue.dequeue(out[0]) && out[0] == "a");
+        require(queue.dequeueBatch(2, out) == 2);
+        require(out[0] == "b" && out[1] == "c");
+        require(queue.dequeueBatch(2, out) == 2);
+        require(out[0] == "d" && out[1] == std::string(100, 'e'));
+        require(!queue.empty());
+        queue.joinGC();
+    }
+
+    // Concurrently, every value comes out exactly once, and each consumer
+    // sees each producer's values in the order they went in.
+    {
+        const std::uint64_t perProducer = 20000;
+        RcuQueue<std::uint64_t> queue;
+        std::vector<std::atomic<int>> seen(4 * perProducer);
+        std::atomic<std::uint64_t> consumed(0);
+
+        threads = std::vector<std::thread>();
+        for (std::uint64_t p = 0; p < 4; ++p) {
+            threads.emplace_back([&, p] {
+                rcu::registerCurrentThread();
+                std::uint64_t batch[8];
+                for (std::uint64_t i = 0; i < perProducer; ) {
+                    if (i % 16 == 0 && perProducer - i >= 8) {
+                        for (std::uint64_t j = 0; j < 8; ++j) {
+                            batch[j] = p * perProducer + i + j;
+                        }
+                        queue.enqueueBatch(batch, batch + 8);
+                        i += 8;
+                    } else {
+                        queue.enqueue(p * perProducer + i);
+                        i++;
+                    }
+                }
+                rcu::unregisterCurrentThread();
+            });
+        }
+        for (int c = 0; c < 4; ++c) {
+            threads.emplace_back([&, c] {
+                rcu::registerCurrentThread();
+                std::uint64_t last[4] = { 0, 0, 0, 0 };
+                bool any[4] = { false, false, false, false };
+                std::uint64_t out[5];
+                while (consumed.load() < 4 * perProducer) {
+                    auto n = c % 2 == 0 ? queue.dequeueBatch(5, out)
+                                        : queue.dequeue(out[0]) ? 1 : 0;
+                    if (n == 0) {
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    for (size_t i = 0; i < n; ++i) {
+                        auto p = out[i] / perProducer;
+                        require(!any[p] || out[i] > last[p]);
+                        any[p] = true;
+                        last[p] = out[i];
+                        seen[out[i]].fetch_add(1);
+                    }
+                    consumed.fetch_add(n);
+                }
+                rcu::unregisterCurrentThread();
+            });
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+
+        require(consumed.load() == 4 * perProducer);
+        for (auto &count: seen) {
+            require(count.load() == 1);
+        }
+        require(queue.empty());
+        queue.joinGC();
+    }
+
+    // Whichever SIMD search this CPU gets agrees with the obvious one, at
+    // every length and position.
+    std::uint64_t haystack[40];
+    for (std::uint64_t i = 0; i < 40; ++i) {
+        haystack[i] = i * 3;
+    }
+    for (size_t n = 0; n <= 40; ++n) {
+        for (std::uint64_t value = 0; value < 130; ++value) {
+            require(rcu::containsValue(haystack, n, value)
+                    == (value % 3 == 0 && value / 3 < n));
+        }
+    }
+
+    // Latency histogram buckets tile the values without gaps, and
+    // percentiles land within a bucket of the truth.
+    for (size_t b = 0; b + 1 < rcu::HISTOGRAM_BUCKETS; ++b) {
+        require(rcu::LatencyHistogram::bucketHighest(b) + 1
+                == rcu::LatencyHistogram::bucketLowest(b + 1));
+    }
+    require(rcu::LatencyHistogram::bucketHighest(rcu::HISTOGRAM_BUCKETS - 1)
+            == UINT64_MAX);
+    for (std::uint64_t value = 1; value < UINT64_MAX / 3;
+         value = value * 3 + 1) {
+        auto bucket = rcu::LatencyHistogram::bucketFor(value);
+        require(rcu::LatencyHistogram::bucketLowest(bucket) <= value
+             && value <= rcu::LatencyHistogram::bucketHighest(bucket));
+    }
+    rcu::LatencyHistogram histogram;
+    for (std::uint64_t value = 1; value <= 10000; ++value) {
+        histogram.record(value);
+    }
+    require(histogram.count() == 10000 && histogram.max() == 10000);
+    require(histogram.mean() == 5000.5);
+    for (double p: { 0.1, 0.5, 0.9, 0.99 }) {
+        auto value = histogram.percentile(p);
+        require(value >= p * 10000 && value <= p * 10000 * 1.07);
+    }
+    require(histogram.percentile(1) == 10000);
+
+    RcuList list;
+    testList(list);
+
+    // Batches come off in the same order as single values.
+    RcuList batchList;
+    std::vector<std::uint64_t> batch { 1, 2, 3, 4, 5 };
+    batchList.pushBatch(batch.begin(), batch.end());
+    batchList.push(6);
+    std::uint64_t popped[8];
+    require(batchList.popBatch(2, popped) == 2);
+    require(popped[0] == 6 && popped[1] == 5);
+    require(batchList.pop() == 4);
+    require(batchList.popBatch(8, popped) == 3);
+    require(popped[0] == 3 && popped[1] == 2 && popped[2] == 1);
+    require(batchList.popBatch(8, popped) == 0);
+    batchList.pushBatch(batch.end(), batch.end());
+    require(batchList.pop() == 0xDEAD);
+
+    // Between them, concurrent pushes and pops, batched or contended enough
+    // to go through the elimination array, pop everything that was pushed,
+    // exactly once. (Values start above 0xDEAD, which means empty.)
+    for (size_t batch: { 1, 37 }) {
+        std::atomic<bool> go(false);
+        const std::uint64_t base = 0x10000;
+        const std::uint64_t perThread = 1000;
+        std::vector<std::vector<std::uint64_t>> poppedBy(8);
+        std::vector<std::thread> threads;
+        for (std::uint64_t t = 0; t < poppedBy.size(); ++t) {
+            threads.emplace_back(modifyBatch, std::ref(go),
+                                 std::ref(batchList), base + t * perThread,
+                                 base + (t + 1) * perThread, batch,
+                                 std::ref(poppedBy[t]));
+        }
+        go.store(true, std::memory_order_relaxed);
+        for (auto &thread: threads) {
+            thread.join();
+        }
+
+        std::vector<bool> seen(poppedBy.size() * perThread, false);
+        for (auto &values: poppedBy) {
+            for (auto value: values) {
+                require(value >= base && value - base < seen.size()
+                     && !seen[value - base]);
+                seen[value - base] = true;
+            }
+        }
+        require(batchList.pop() == 0xDEAD);
+    }
+
+    // The unrolled list behaves the same, with default-sized nodes and with
+    // page-sized ones.
+    RcuUnrolledList<> unrolledList;
+    testList(unrolledList);
+    RcuUnrolledList<4096> pageList;
+    testList(pageList);
+
+    std::atomic<bool> go(false);
+
+    // The single-threaded HAMT.
+    Hamt hamt;
+
+    for (std::uint64_t i = 0; i < upper; ++i) {
+        hamt.insert(std::to_string(i));
+    }
+    for (std::uint64_t i = 0; i < upper; ++i) {
+        require(hamt.find(std::to_string(i)));
+    }
+    require(!hamt.find(std::to_string(upper)));
+
+    for (std::uint64_t i = 0; i < upper; i += 2) {
+        require(hamt.erase(std::to_string(i)));
+    }
+    for (std::uint64_t i = 0; i < upper; ++i) {
+        require(hamt.find(std::to_string(i)) == (i % 2 == 1));
+    }
+
+    // Keys too long to be stored inline.
+    const std::string longKey(100, 'x');
+    hamt.insert(std::string(longKey));
+    require(hamt.find(longKey));
+    require(!hamt.find(longKey + "y"));
+    require(hamt.erase(longKey));
+    require(!hamt.find(longKey));
+
+    // Batched lookups agree with find, down to a partial last group.
+    std::vector<std::string> keys;
+    for (std::uint64_t i = 0; i < 1001; ++i) {
+        keys.push_back(std::to_string(i));
+    }
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    hamt.findBatch(keys.data(), keys.size(), found.get());
+    for (std::uint64_t i = 0; i < keys.size(); ++i) {
+        require(found[i] == (i % 2 == 1));
+    }
+
+    // The RCU one, first on its own.
+    RcuHamt rcuHamt;
+
+    for (std::uint64_t i = 0; i < lower; ++i) {
+        rcuHamt.insert(std::to_string(i));
+    }
+    rcuHamt.insert(std::to_string(0));
+    for (std::uint64_t i = 0; i < lower; ++i) {
+        require(rcuHamt.find(std::to_string(i)));
+    }
+    require(!rcuHamt.find(std::to_string(lower)));
+
+    for (std::uint64_t i = 0; i < lower; ++i) {
+        require(rcuHamt.erase(std::to_string(i)));
+    }
+    require(!rcuHamt.erase(std::to_string(0)));
+    for (std::uint64_t i = 0; i < lower; ++i) {
+        require(!rcuHamt.find(std::to_string(i)));
+    }
+
+    // Then the same keys as the list test stay put while writers churn the
+    // rest of the trie.
+    for (uint64_t i = upper; i < upper + 10000; ++i) {
+        rcuHamt.insert(std::to_string(i));
+    }
+
+    go.store(false);
+    threads = std::vector<std::thread>();
+
+    threads.emplace_back(hamtModify, std::ref(go), std::ref(rcuHamt),
+                         0, lower);
+    threads.emplace_back(hamtModify, std::ref(go), std::ref(rcuHamt),
+                         lower, upper);
+
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back(hamtSearch, std::ref(go), std::cref(rcuHamt));
+    }
+
+    go.store(true);
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    for (std::uint64_t i = 0; i < upper; ++i) {
+        require(!rcuHamt.find(std::to_string(i)));
+    }
+
+    rcu::barrier();
+
+    // Snapshots keep their version however the trie changes, diffs find
+    // exactly what changed between them, and only what snapshots can reach
+    // is held back from reclamation.
+    {
+        RcuHamt versioned;
+        auto keysOf = [](const RcuHamt::Snapshot &snapshot) {
+            std::set<std::string> keys;
+            snapshot.forEach([&](std::string_view key) {
+                require(keys.emplace(key).second);
+            });
+            return keys;
+        };
+        auto noKey = [](std::string_view) { die(); };
+
+        for (std::uint64_t i = 0; i < 1000; ++i) {
+            versioned.insert(std::to_string(i));
+        }
+
+        {
+            auto before = versioned.snapshot();
+            for (std::uint64_t i = 0; i < 500; i += 2) {
+                require(versioned.erase(std::to_string(i)));
+            }
+            for (std::uint64_t i = 1000; i < 1100; ++i) {
+                versioned.insert(std::to_string(i));
+            }
+            auto after = versioned.snapshot();
+            require(after.version() == before.version() + 350);
+
+            // Everything this retires was created after both snapshots, so
+            // none of it is held back.
+            for (int pass = 0; pass < 10; ++pass) {
+                for (std::uint64_t i = 2000; i < 3000; ++i) {
+                    versioned.insert(std::to_string(i));
+                }
+                for (std::uint64_t i = 2000; i < 3000; ++i) {
+                    require(versioned.erase(std::to_string(i)));
+                }
+            }
+            rcu::barrier();
+            require(versioned.heldNodeCount() > 0);
+            require(versioned.heldNodeCount() < 4000);
+
+            require(keysOf(before).size() == 1000);
+            require(keysOf(after).size() == 850);
+            for (std::uint64_t i = 0; i < 1100; ++i) {
+                auto key = std::to_string(i);
+                require(before.find(key) == (i < 1000));
+                require(after.find(key) == (i >= 500 || i % 2 == 1));
+            }
+
+            std::set<std::string> removed;
+            std::set<std::string> added;
+            RcuHamt::diff(before, after,
+                          [&](std::string_view key) {
+                              require(removed.emplace(key).second);
+                          },
+                          [&](std::string_view key) {
+                              require(added.emplace(key).second);
+                          });
+            require(removed.size() == 250 && added.size() == 100);
+            for (std::uint64_t i = 0; i < 500; i += 2) {
+                require(removed.count(std::to_string(i)));
+            }
+            for (std::uint64_t i = 1000; i < 1100; ++i) {
+                require(added.count(std::to_string(i)));
+            }
+
+            std::uint64_t backwards = 0;
+            RcuHamt::diff(after, before,
+                          [&](std::string_view key) {
+                              require(added.count(std::string(key)));
+                              backwards++;
+                          },
+                          [&](std::string_view key) {
+                              require(removed.count(std::string(key)));
+                              backwards++;
+                          });
+            require(backwards == 350);
+            RcuHamt::diff(after, after, noKey, noKey);
+
+            // The churn left the same keys in a differently shaped trie.
+            auto moved = std::move(after);
+            after = versioned.snapshot();
+            require(after.version() == moved.version() + 20000);
+            RcuHamt::diff(moved, after, noKey, noKey);
+        }
+        require(versioned.heldNodeCount() == 0);
+
+        // Each snapshot is a single consistent version, even mid-write:
+        // the writer adds each "a" key before its "b" key and erases them
+        // the other way around, and diffs between snapshots add up.
+        std::atomic<bool> done(false);
+        std::thread writer([&] {
+            rcu::registerCurrentThread();
+            while (!done.load()) {
+                for (std::uint64_t i = 0; i < 100; ++i) {
+                    versioned.insert("a" + std::to_string(i));
+                    versioned.insert("b" + std::to_string(i));
+                }
+                for (std::uint64_t i = 0; i < 100; ++i) {
+                    require(versioned.erase("b" + std::to_string(i)));
+                    require(versioned.erase("a" + std::to_string(i)));
+                }
+            }
+            rcu::unregisterCurrentThread();
+        });
+
+        auto last = versioned.snapshot();
+        auto lastKeys = keysOf(last);
+        for (int i = 0; i < 50; ++i) {
+            auto next = versioned.snapshot();
+            auto nextKeys = keysOf(next);
+            for (auto &key: nextKeys) {
+                if (key[0] == 'b') require(next.find("a" + key.substr(1)));
+            }
+
+            RcuHamt::diff(last, next,
+                          [&](std::string_view key) {
+                              require(lastKeys.erase(std::string(key)));
+                          },
+                          [&](std::string_view key) {
+                              require(lastKeys.emplace(key).second);
+                          });
+            require(lastKeys == nextKeys);
+            last = std::move(next);
+        }
+
+        done.store(true);
+        writer.join();
+    }
+
+    // The skip list, first on its own.
+    SkipList skipList;
+
+    for (std::uint64_t i = 0; i < 1000; ++i) {
+        require(skipList.insert((i * 7919) % 1000, 0));
+    }
+    require(!skipList.insert(5, 0));
+    for (std::uint64_t i = 0; i < 1000; i += 2) {
+        require(skipList.erase(i));
+    }
+    require(!skipList.erase(0));
+    require(!skipList.contains(10) && skipList.contains(11));
+
+    std::vector<std::uint64_t> inRange;
+    skipList.forEachInRange(100, 111, [&](std::uint64_t key, std::uint64_t) {
+        inRange.push_back(key);
+    });
+    require(inRange == std::vector<std::uint64_t>({ 101, 103, 105, 107,
+                                                    109 }));
+
+    for (std::uint64_t i = 1; i < 1000; i += 2) {
+        require(skipList.erase(i));
+    }
+
+    // Then with stable keys staying put while several threads fight over
+    // the same range.
+    for (std::uint64_t i = upper; i < upper + 10000; ++i) {
+        skipList.insert(i, i * 2);
+    }
+
+    std::atomic<std::uint64_t> inserted(0);
+    std::atomic<std::uint64_t> erased(0);
+    go.store(false);
+    threads = std::vector<std::thread>();
+
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back(skipListModify, std::ref(go), std::ref(skipList),
+                             0, upper, std::ref(inserted), std::ref(erased));
+    }
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back(skipListSearch, std::ref(go),
+                             std::cref(skipList));
+    }
+
+    go.store(true);
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    std::uint64_t left = 0;
+    skipList.forEachInRange(0, upper, [&](std::uint64_t, std::uint64_t) {
+        left++;
+    });
+    require(inserted.load() == erased.load() + left);
+
+    // The hash map grows and shrinks with its contents.
+    HashMap hashMap;
+
+    for (std::uint64_t i = 0; i < lower; ++i) {
+        require(hashMap.insert(i, i * 2));
+    }
+    require(!hashMap.insert(0, 0));
+    require(hashMap.size() == lower);
+    require(hashMap.bucketCount() * HASH_MAP_MAX_LOAD >= lower);
+    for (std::uint64_t i = 0; i < lower; ++i) {
+        std::uint64_t value;
+        require(hashMap.find(i, value) && value == i * 2);
+    }
+    require(!hashMap.contains(lower));
+
+    for (std::uint64_t i = 0; i < lower; ++i) {
+        require(hashMap.erase(i));
+    }
+    require(!hashMap.erase(0));
+    require(hashMap.bucketCount() == HASH_MAP_MIN_BUCKETS);
+
+    // Readers never miss a key, even while the table is resized under them
+    // over and over.
+    for (uint64_t i = upper; i < upper + 10000; ++i) {
+        hashMap.insert(i, i * 2);
+    }
+
+    go.store(false);
+    threads = std::vector<std::thread>();
+
+    threads.emplace_back(hashMapModify, std::ref(go), std::ref(hashMap),
+                         0, upper);
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back(hashMapSearch, std::ref(go), std::cref(hashMap));
+    }
+
+    go.store(true);
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    require(hashMap.size() == 10000);
+
+    // A QSBR grace period waits for online threads to announce a quiescent
+    // state, and for nothing else.
+    {
+        std::atomic<int> stage(0);
+        std::atomic<bool> synchronized(false);
+
+        auto waitFor = [&](int target) {
+            while (stage.load() != target) std::this_thread::yield();
+        };
+
+        std::thread reader([&] {
+            rcu::registerCurrentThread();
+            rcu::threadOnline();
+            stage.store(1);
+            waitFor(2);
+            while (stage.load() != 3) {
+                rcu::quiescentState();
+                std::this_thread::yield();
+            }
+            rcu::unregisterCurrentThread();
+        });
+        waitFor(1);
+
+        std::thread writer([&] {
+            rcu::registerCurrentThread();
+            rcu::QsbrFlavor::synchronize();
+            synchronized.store(true);
+            rcu::unregisterCurrentThread();
+        });
+
+        std::this_thread::sleep_for(20ms);
+        require(!synchronized.load());
+        stage.store(2);
+        writer.join();
+        require(synchronized.load());
+
+        // The reader is still online, but other flavors don't wait for it,
+        // and an online caller doesn't wait for itself.
+        rcu::synchronize();
+        rcu::threadOnline();
+        rcu::QsbrFlavor::synchronize();
+        rcu::threadOffline();
+
+        stage.store(3);
+        reader.join();
+        rcu::QsbrFlavor::synchronize();
+    }
+
+    // Containers work the same with QSBR.
+    QsbrList qsbrList;
+    for (uint64_t i = upper; i < upper + 10000; ++i) {
+        qsbrList.push(i);
+    }
+
+    go.store(false);
+    threads = std::vector<std::thread>();
+
+    threads.emplace_back(qsbrModify, std::ref(go), std::ref(qsbrList),
+                         0, lower);
+    threads.emplace_back(qsbrModify, std::ref(go), std::ref(qsbrList),
+                         lower, upper);
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back(qsbrSearch, std::ref(go), std::ref(qsbrList));
+    }
+
+    go.store(true);
+
     for (auto &thread: threads) {
         thread.join();
     }
@@ -130,6 +1418,34 @@ int main(void) {
     rcu::unregisterCurrentThread();
 
     list.joinGC();
+    batchList.joinGC();
+    unrolledList.joinGC();
+    pageList.joinGC();
+    skipList.joinGC();
+    hashMap.joinGC();
+    qsbrList.joinGC();
+
+    // With every GC joined, everything published was reclaimed. Without
+    // stats, nothing was counted at all.
+    auto stats = rcu::statsSnapshot();
+    auto &gracePeriods = stats.get(rcu::Latency::GRACE_PERIOD);
+    if (rcu::STATS_ENABLED) {
+        require(stats.get(rcu::Stat::GRACE_PERIODS) > 0);
+        require(gracePeriods.count()
+                == stats.get(rcu::Stat::GRACE_PERIODS)
+                 + stats.get(rcu::Stat::SHARED_GRACE_PERIODS));
+        require(stats.get(rcu::Latency::QSBR_GRACE_PERIOD).count()
+                == stats.get(rcu::Stat::QSBR_GRACE_PERIODS));
+        require(stats.get(rcu::Stat::GC_PUBLISHED) > 0);
+        require(stats.get(rcu::Stat::GC_PUBLISHED)
+                == stats.get(rcu::Stat::GC_RECLAIMED));
+        require(stats.get(rcu::Latency::RECLAIM_DELAY).count() > 0);
+    } else {
+        require(gracePeriods.count() == 0);
+        for (size_t i = 0; i < rcu::STAT_COUNT; ++i) {
+            require(stats.counters[i] == 0);
+        }
+    }
 
     return 0;
 }